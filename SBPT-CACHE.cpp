@@ -13,11 +13,46 @@
 #include <time.h>
 #include <sys/time.h>
 
-extern "C" {
-#include <d4.h>
-}
+#include "cache-config.h"
+
+// Dinero IV must be configured for 64-bit addresses (SIZEOF_VOIDP in d4-7/config.h).
+static_assert(sizeof(d4addr) >= sizeof(ADDRINT), "d4addr cannot hold an application address");
+
+KNOB<std::string> KnobCacheConfig(KNOB_MODE_WRITEONCE, "pintool", "cache_config", "", "Simulate every cache hierarchy in this file (see cache-config.h)");
+
+/*
+ * Every memory access made by a kernel is fed through each hierarchy in turn.
+ * Without -cache_config, the single hierarchy is the one this tool has always
+ * simulated.
+ */
+struct SimulatedHierarchy
+{
+	CacheConfig Config;
+	std::vector<d4cache *> Levels;
+	std::vector<CacheSnapshot> KernelStart;
+};
+
+static std::vector<SimulatedHierarchy> Hierarchies;
+
+/*
+ * References are buffered and handed to Dinero IV in batches, which walks
+ * each batch through a hierarchy one level at a time.  The buffer must be
+ * flushed before the cache statistics are looked at.
+ */
+#define CACHE_BATCH_SIZE 4096
 
-d4cache *mm, *l2, *l1d;
+static d4memref CacheBatch[CACHE_BATCH_SIZE];
+static unsigned int CacheBatchUsed;
+
+static void FlushCacheBatch()
+{
+	if (!CacheBatchUsed) return;
+
+	for (auto& hierarchy : Hierarchies)
+		d4refbatch(hierarchy.Levels[0], CacheBatch, CacheBatchUsed);
+
+	CacheBatchUsed = 0;
+}
 
 static uint64_t now()
 {
@@ -63,45 +98,24 @@ static int CurrentFrameIndex;
 
 #define SKIP_FRAME 5
 
-/*static void DumpCacheStats()
+static void SnapshotCacheStats()
 {
-	uint64_t rhits = (uint64_t)l1d->fetch[D4XREAD] - (uint64_t)l1d->miss[D4XREAD];
-	uint64_t rmisses= (uint64_t)l1d->miss[D4XREAD];
-	uint64_t raccesses = rhits + rmisses;
-	
-	uint64_t whits = (uint64_t)l1d->fetch[D4XWRITE] - (uint64_t)l1d->miss[D4XWRITE];
-	uint64_t wmisses= (uint64_t)l1d->miss[D4XWRITE];
-	uint64_t waccesses = whits + wmisses;
-	
-	fprintf(stderr, "L1D: R Hit Ratio=%lf%%, Miss Ratio=%lf%%\n", ((double)rhits / (double)raccesses) * 100.f, ((double)rmisses / (double)raccesses) * 100.f);
-	fprintf(stderr, "L1D: W Hit Ratio=%lf%%, Miss Ratio=%lf%%\n", ((double)whits / (double)waccesses) * 100.f, ((double)wmisses / (double)waccesses) * 100.f);
-	
-	/ * fprintf(stderr, "l1d: read:  accesses=%lu, hits=%lu, misses=%lu\n", (uint64_t)l1d->fetch[D4XREAD], (uint64_t)l1d->fetch[D4XREAD] - (uint64_t)l1d->miss[D4XREAD], (uint64_t)l1d->miss[D4XREAD]);
-	fprintf(stderr, "l1d: write: accesses=%lu, hits=%lu, misses=%lu\n", (uint64_t)l1d->fetch[D4XWRITE], (uint64_t)l1d->fetch[D4XWRITE] - (uint64_t)l1d->miss[D4XWRITE], (uint64_t)l1d->miss[D4XWRITE]);
-
-	fprintf(stderr, "l2:  read:  accesses=%lu, hits=%lu, misses=%lu\n", (uint64_t)l2->fetch[D4XREAD], (uint64_t)l2->fetch[D4XREAD] - (uint64_t)l2->miss[D4XREAD], (uint64_t)l2->miss[D4XREAD]);
-	fprintf(stderr, "l2:  write: accesses=%lu, hits=%lu, misses=%lu\n", (uint64_t)l2->fetch[D4XWRITE], (uint64_t)l2->fetch[D4XWRITE] - (uint64_t)l2->miss[D4XWRITE], (uint64_t)l2->miss[D4XWRITE]);
-	
-	fprintf(stderr, "mem: read:  accesses=%lu, hits=%lu, misses=%lu\n", (uint64_t)mm->fetch[D4XREAD], (uint64_t)mm->fetch[D4XREAD] - (uint64_t)mm->miss[D4XREAD], (uint64_t)mm->miss[D4XREAD]);
-	fprintf(stderr, "mem: write: accesses=%lu, hits=%lu, misses=%lu\n", (uint64_t)mm->fetch[D4XWRITE], (uint64_t)mm->fetch[D4XWRITE] - (uint64_t)mm->miss[D4XWRITE], (uint64_t)mm->miss[D4XWRITE]);* /
-}*/
+	for (auto& hierarchy : Hierarchies)
+		SnapshotCacheHierarchy(hierarchy.Levels, hierarchy.KernelStart);
+}
 
-static void ResetCacheStats()
+static void DumpCacheStats(const std::string& kernel)
 {
-	l1d->fetch[D4XREAD] = 0;
-	l1d->miss[D4XREAD] = 0;
-	l1d->fetch[D4XWRITE] = 0;
-	l1d->miss[D4XWRITE] = 0;
-	
-	l2->fetch[D4XREAD] = 0;
-	l2->miss[D4XREAD] = 0;
-	l2->fetch[D4XWRITE] = 0;
-	l2->miss[D4XWRITE] = 0;
-
-	mm->fetch[D4XREAD] = 0;
-	mm->miss[D4XREAD] = 0;
-	mm->fetch[D4XWRITE] = 0;
-	mm->miss[D4XWRITE] = 0;
+	for (const auto& hierarchy : Hierarchies) {
+		std::vector<CacheSnapshot> now, delta;
+		SnapshotCacheHierarchy(hierarchy.Levels, now);
+
+		delta.resize(now.size());
+		for (size_t i = 0; i < now.size(); i++)
+			delta[i].Accumulate(hierarchy.KernelStart[i], now[i]);
+
+		PrintCacheReport(stderr, hierarchy.Config, kernel, delta);
+	}
 }
 
 void FrameStart()
@@ -132,7 +146,7 @@ void KernelRoutineEnter(KernelDescriptor *descriptor)
 	CurrentKernel = new KernelInvocation(descriptor);
 	CurrentKernel->Duration = now();
 
-	ResetCacheStats();
+	SnapshotCacheStats();
 
 	/*d4memref memref;
 	memref.address = (d4addr)addr;
@@ -151,51 +165,55 @@ void KernelRoutineExit(KernelDescriptor *descriptor)
 	CurrentKernel->Descriptor->TotalExecutionCount++;
 	CurrentKernel->Descriptor->TotalExecutionTime += CurrentKernel->Duration;
 	
+	FlushCacheBatch();
+
 	if (CurrentFrame->Index >= SKIP_FRAME) {
-		/*fprintf(stderr, "**** KERNEL CACHE STATS %s ****\n", CurrentKernel->Descriptor->Name.c_str());
-		DumpCacheStats();
-		fprintf(stderr, "************\n");*/
-		
-		uint64_t rhits = (uint64_t)l1d->fetch[D4XREAD] - (uint64_t)l1d->miss[D4XREAD];
-		uint64_t rmisses= (uint64_t)l1d->miss[D4XREAD];
-		uint64_t raccesses = rhits + rmisses;
-
-		uint64_t whits = (uint64_t)l1d->fetch[D4XWRITE] - (uint64_t)l1d->miss[D4XWRITE];
-		uint64_t wmisses= (uint64_t)l1d->miss[D4XWRITE];
-		uint64_t waccesses = whits + wmisses;
-		
-		std::cerr << CurrentKernel->Descriptor->Name << ","
-				<< std::dec << raccesses << "," << rhits << "," << rmisses << ","
-				<< std::dec << waccesses << "," << whits << "," << wmisses << std::endl;
+		DumpCacheStats(CurrentKernel->Descriptor->Name);
 	}
 	
 	CurrentKernel = NULL;
 }
 
-static void MemoryAccessCommon(uintptr_t addr, bool read)
+static void MemoryAccessCommon(uintptr_t addr, uint32_t size, bool read)
 {
-	d4memref memref;
+	// Dinero IV splits references that cross a block boundary itself.
+	d4memref& memref = CacheBatch[CacheBatchUsed++];
 	memref.address = (d4addr)addr;
-	memref.size = 4;
+	memref.size = size;
 	memref.accesstype = read ? D4XREAD : D4XWRITE;
 
-	d4ref(l1d, memref);
+	if (CacheBatchUsed == CACHE_BATCH_SIZE)
+		FlushCacheBatch();
 }
 
-void MemoryReadInstruction(void *rip, uintptr_t addr)
+void MemoryReadInstruction(void *rip, uintptr_t addr, uint32_t size)
 {
 	if (!CurrentKernel) return;
 	if (CurrentFrame->Index < SKIP_FRAME) return;
 
-	MemoryAccessCommon(addr, true);
+	MemoryAccessCommon(addr, size, true);
 }
 
-void MemoryWriteInstruction(void *rip, uintptr_t addr)
+void MemoryWriteInstruction(void *rip, uintptr_t addr, uint32_t size)
 {
 	if (!CurrentKernel) return;
 	if (CurrentFrame->Index < SKIP_FRAME) return;
 	
-	MemoryAccessCommon(addr, false);
+	MemoryAccessCommon(addr, size, false);
+}
+
+/* Gathers and scatters access one element per active lane */
+void MemoryVectorInstruction(void *rip, PIN_MULTI_MEM_ACCESS_INFO *info)
+{
+	if (!CurrentKernel) return;
+	if (CurrentFrame->Index < SKIP_FRAME) return;
+
+	for (UINT32 i = 0; i < info->numberOfMemops; i++) {
+		const PIN_MEM_ACCESS_INFO& memop = info->memop[i];
+		if (!memop.maskOn) continue;
+
+		MemoryAccessCommon(memop.memoryAddress, memop.bytesAccessed, memop.memopType == PIN_MEMOP_LOAD);
+	}
 }
 
 std::map<std::string, std::string> KernelNameMap;
@@ -243,15 +261,25 @@ void Routine(RTN rtn, VOID *v)
 
 void Instruction(INS ins, VOID *p)
 {
+	// The element addresses of a gather or scatter are only known at run time.
+	if (INS_HasMemoryVector(ins)) {
+		INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryVectorInstruction, IARG_INST_PTR, IARG_MULTI_MEMORYACCESS_EA, IARG_END);
+		return;
+	}
+
 	unsigned int operand_count = INS_MemoryOperandCount(ins);
 	if (operand_count > 0) {
 		for (unsigned int operand_index = 0; operand_index < operand_count; operand_index++) {
+			uint32_t size = INS_MemoryOperandSize(ins, operand_index);
+
 			if (INS_MemoryOperandIsRead(ins, operand_index)) {
-				INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryReadInstruction, IARG_INST_PTR, IARG_MEMORYOP_EA, operand_index, IARG_END);
+				INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryReadInstruction, IARG_INST_PTR, IARG_MEMORYOP_EA, operand_index,
+					IARG_UINT32, size, IARG_END);
 			}
 
 			if (INS_MemoryOperandIsWritten(ins, operand_index)) {
-				INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryWriteInstruction, IARG_INST_PTR, IARG_MEMORYOP_EA, operand_index, IARG_END);
+				INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryWriteInstruction, IARG_INST_PTR, IARG_MEMORYOP_EA, operand_index,
+					IARG_UINT32, size, IARG_END);
 			}
 		}
 	}
@@ -282,64 +310,63 @@ static void LoadFriendlyNames()
 	KernelNameMap["_Z16updatePoseKernelR8sMatrix4PKff"] = "UpdatePose";
 }
 
+/* 32KB 4-way random L1D, 1MB 8-way LRU L2, 64B lines: [baseline] in caches.ini */
+static CacheConfig DefaultCacheConfig()
+{
+	CacheConfig config;
+	config.Name = "baseline";
+
+	CacheLevelConfig l1d;
+	l1d.Name = "l1d";
+	l1d.Size = 32 << 10;
+	l1d.BlockSize = l1d.SubblockSize = 64;
+	l1d.Assoc = 4;
+	l1d.Replacement = "random";
+	l1d.WriteAlloc = "always";
+	l1d.WriteBack = "never";
+	config.Levels.push_back(l1d);
+
+	CacheLevelConfig l2;
+	l2.Name = "l2";
+	l2.Size = 1 << 20;
+	l2.BlockSize = l2.SubblockSize = 64;
+	l2.Assoc = 8;
+	l2.Replacement = "lru";
+	l2.WriteAlloc = "never";
+	l2.WriteBack = "never";
+	config.Levels.push_back(l2);
+
+	return config;
+}
+
 static void InitCache()
 {
-	mm = d4new(NULL);
-	mm->name = (char *)"memory";
-	
-	l2 = d4new(mm);
-	l2->name = (char *)"l2";
-	l2->flags = 0;
-		
-	l2->lg2blocksize = 6;
-	l2->lg2subblocksize = 6;
-	l2->lg2size = 20;
-	l2->assoc = 8;
-	
-	l2->replacementf = d4rep_lru;
-	l2->name_replacement = (char *)"LRU";
-	
-	l2->prefetchf = d4prefetch_none;
-	l2->name_prefetch = (char *)"demand only";
-	
-	l2->wallocf = d4walloc_never;
-	l2->name_walloc = (char *)"never";
-	
-	l2->wbackf = d4wback_never;
-	l2->name_wback = (char *)"never";
-	
-	l2->prefetch_distance = 6;
-	l2->prefetch_abortpercent = 0;
-	
-	l1d = d4new(l2);
-	l1d->name = (char *)"l1d";
-	l1d->flags = 0;
-		
-	l1d->lg2blocksize = 6;
-	l1d->lg2subblocksize = 6;
-	l1d->lg2size = 15;
-	l1d->assoc = 4;
-	
-	l1d->replacementf = d4rep_random;
-	l1d->name_replacement = (char *)"random";
-	
-	l1d->prefetchf = d4prefetch_none;
-	l1d->name_prefetch = (char *)"demand only";
-	
-	l1d->wallocf = d4walloc_always;
-	l1d->name_walloc = (char *)"always";
-	
-	l1d->wbackf = d4wback_never;
-	l1d->name_wback = (char *)"never";
-	
-	l1d->prefetch_distance = 6;
-	l1d->prefetch_abortpercent = 0;
-	
-	int err = d4setup();
-	if (err) {
-		fprintf(stderr, "ERROR: %d\n", err);
-		_exit(-1);
+	std::vector<CacheConfig> configs;
+
+	if (KnobCacheConfig.Value().empty()) {
+		configs.push_back(DefaultCacheConfig());
+	} else {
+		std::string error;
+		if (!LoadCacheConfigs(KnobCacheConfig.Value().c_str(), configs, error)) {
+			fprintf(stderr, "ERROR: %s\n", error.c_str());
+			_exit(-1);
+		}
 	}
+
+	Hierarchies.resize(configs.size());
+	for (size_t i = 0; i < configs.size(); i++) {
+		Hierarchies[i].Config = configs[i];
+
+		int err = BuildCacheHierarchy(configs[i], Hierarchies[i].Levels);
+		if (err) {
+			fprintf(stderr, "ERROR: %d\n", err);
+			_exit(-1);
+		}
+
+		std::cerr << "Simulating cache hierarchy: " << configs[i].Name << std::endl;
+	}
+
+	fprintf(stderr, "%s\n", CACHE_REPORT_HEADER);
 }
 
 int main(int argc, char *argv[])
@@ -1,6 +1,7 @@
 #include "pin.H"
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <iostream>
@@ -8,6 +9,7 @@
 #include <fstream>
 #include <list>
 #include <map>
+#include <sstream>
 #include <set>
 #include <unordered_map>
 #include <time.h>
@@ -16,6 +18,8 @@ KNOB<bool> KnobTraceMemory(KNOB_MODE_WRITEONCE, "pintool", "trace_mem", "0", "Sh
 KNOB<bool> KnobTraceReuse(KNOB_MODE_WRITEONCE, "pintool", "trace_reuse", "0", "Should trace reuses");
 KNOB<bool> KnobTraceTimes(KNOB_MODE_WRITEONCE, "pintool", "trace_timing", "0", "Should trace times");
 KNOB<bool> KnobTraceKInst(KNOB_MODE_WRITEONCE, "pintool", "trace_kinst", "0", "Should trace kernel instructions");
+KNOB<bool> KnobTraceKMem(KNOB_MODE_WRITEONCE, "pintool", "trace_kmem", "0", "Should trace kernel memory accesses");
+KNOB<std::string> KnobTraceStream(KNOB_MODE_WRITEONCE, "pintool", "trace_stream", "", "Write the trace live to this pipe, instead of to per-thread files");
 KNOB<bool> KnobTraceSeq(KNOB_MODE_WRITEONCE, "pintool", "trace_seq", "0", "Should trace instruction sequences");
 
 static uint64_t now()
@@ -72,12 +76,13 @@ struct KernelMemoryInstruction
 
 struct KernelDescriptor
 {
-	KernelDescriptor(int _id, std::string _name) : ID(_id), Name(_name), TotalExecutionCount(0), TotalExecutionTime(0) { }
+	KernelDescriptor(int _id, std::string _name) : ID(_id), Name(_name), TotalExecutionCount(0), TotalExecutionTime(0), Described(false) { }
 	
 	int ID;
 	std::string Name;
 	uint64_t TotalExecutionCount;
 	uint64_t TotalExecutionTime;
+	bool Described;
 	
 	std::unordered_map<uintptr_t, KernelMemoryInstruction *> MemoryInstructions;
 };
@@ -129,9 +134,268 @@ static int CurrentFrameIndex;
 
 #include "trace-packet.h"
 
-FILE *TraceFile;
+#define TRACE_BUFFER_SIZE (1 << 20)
+
+/*
+ * Each application thread writes its packets into a private buffer, which is
+ * flushed to its own trace.<tid>.bin stream.  The only shared state is the
+ * global sequence counter for sync packets, so capture needs no lock.
+ *
+ * With -trace_stream, buffers are instead written as chunks to a single pipe
+ * that the deducer reads while the application runs.  Only the pipe itself
+ * is locked.  Threads also flush before they might block, and around frames
+ * and kernels, so the reader is never left waiting on a stale buffer.
+ */
+struct ThreadTraceStream
+{
+	THREADID ThreadID;
+	int FD;
+	uint64_t SinceSync;
+	uint64_t KernelEpoch;
+	uint64_t PendingJoin;
+	size_t BufferUsed;
+	uint8_t Buffer[TRACE_BUFFER_SIZE];
+};
+
+static TLS_KEY TraceStreamKey;
+static PIN_LOCK TraceStreamsLock;
+static std::set<ThreadTraceStream *> TraceStreams;
+
+static volatile uint64_t NextSequence;
+static volatile uint64_t KernelEpoch;
+
+static int LiveStreamFD = -1;
+static PIN_LOCK LiveStreamLock;
+
+static inline bool TraceEnabled()
+{
+	return KnobTraceKInst.Value() || KnobTraceKMem.Value();
+}
+
+static inline ThreadTraceStream *GetTraceStream(THREADID tid)
+{
+	if (!TraceEnabled()) return NULL;
+	return (ThreadTraceStream *)PIN_GetThreadData(TraceStreamKey, tid);
+}
+
+static void TraceWrite(ThreadTraceStream *stream, int fd, const void *data, size_t size)
+{
+	size_t offset = 0;
+	while (offset < size) {
+		ssize_t rc = write(fd, (const uint8_t *)data + offset, size - offset);
+		if (rc <= 0) {
+			std::cerr << "Unable to write trace stream for thread " << stream->ThreadID << std::endl;
+			break;
+		}
+
+		offset += rc;
+	}
+}
+
+/* Must be called with LiveStreamLock held when streaming live */
+static void TraceFlushLocked(ThreadTraceStream *stream, bool last)
+{
+	if (LiveStreamFD >= 0) {
+		TraceChunkHeader header;
+		header.ThreadID = stream->ThreadID;
+		header.Length = stream->BufferUsed;
+		header.Flags = last ? TRACE_CHUNK_LAST : 0;
+		header.Watermark = NextSequence;
+
+		TraceWrite(stream, LiveStreamFD, &header, sizeof(header));
+		TraceWrite(stream, LiveStreamFD, stream->Buffer, stream->BufferUsed);
+	} else {
+		TraceWrite(stream, stream->FD, stream->Buffer, stream->BufferUsed);
+	}
+
+	stream->BufferUsed = 0;
+
+	// Whatever comes next starts a new segment, so that a live reader only
+	// ever receives whole segments.
+	stream->SinceSync = TRACE_SYNC_INTERVAL;
+}
+
+static void TraceFlush(ThreadTraceStream *stream, bool last = false)
+{
+	if (LiveStreamFD >= 0) {
+		PIN_GetLock(&LiveStreamLock, stream->ThreadID + 1);
+		TraceFlushLocked(stream, last);
+		PIN_ReleaseLock(&LiveStreamLock);
+	} else {
+		TraceFlushLocked(stream, last);
+	}
+}
+
+/* Lets a live reader move on before this thread does anything that might block */
+static inline void TraceFlushLive(ThreadTraceStream *stream)
+{
+	if (LiveStreamFD >= 0) TraceFlush(stream);
+}
+
+static void TraceSync(ThreadTraceStream *stream);
+
+static inline void TraceEmit(ThreadTraceStream *stream, const void *packet, size_t size)
+{
+	if (stream->BufferUsed + size > sizeof(stream->Buffer)) {
+		TraceFlush(stream);
+
+		if (((const TracePacket *)packet)->Type != TRACE_PACKET_SYNC)
+			TraceSync(stream);
+	}
+
+	memcpy(&stream->Buffer[stream->BufferUsed], packet, size);
+	stream->BufferUsed += size;
+}
+
+static void TraceSync(ThreadTraceStream *stream)
+{
+	SyncTracePacket stp;
+	stp.Type = TRACE_PACKET_SYNC;
+	stp.Sequence = __sync_fetch_and_add(&NextSequence, 1);
+	stp.Timestamp = now();
+	TraceEmit(stream, &stp, sizeof(stp));
+
+	stream->SinceSync = 0;
+	stream->KernelEpoch = KernelEpoch;
+}
+
+static void TraceEvent(ThreadTraceStream *stream, uint8_t type)
+{
+	TracePacket tp;
+	tp.Type = type;
+
+	TraceSync(stream);
+	TraceEmit(stream, &tp, sizeof(tp));
+}
 
-void FrameStart()
+static void TraceDescribe(ThreadTraceStream *stream, uint8_t kind, uint32_t id, uint32_t category, const std::string& name)
+{
+	DescriptorTracePacket dtp;
+	memset(&dtp, 0, sizeof(dtp));
+	dtp.Type = TRACE_PACKET_DESCRIPTOR;
+	dtp.Kind = kind;
+	dtp.ID = id;
+	dtp.Category = category;
+	strncpy(dtp.Name, name.c_str(), sizeof(dtp.Name) - 1);
+
+	TraceSync(stream);
+	TraceEmit(stream, &dtp, sizeof(dtp));
+}
+
+static void TraceCloseStream(ThreadTraceStream *stream)
+{
+	TraceFlush(stream, true);
+	if (stream->FD >= 0) close(stream->FD);
+
+	PIN_GetLock(&TraceStreamsLock, stream->ThreadID + 1);
+	TraceStreams.erase(stream);
+	PIN_ReleaseLock(&TraceStreamsLock);
+
+	delete stream;
+}
+
+void ThreadStart(THREADID tid, CONTEXT *ctx, INT32 flags, VOID *v)
+{
+	if (!TraceEnabled()) return;
+
+	ThreadTraceStream *stream = new ThreadTraceStream();
+	stream->ThreadID = tid;
+	stream->FD = -1;
+
+	if (LiveStreamFD < 0) {
+		std::stringstream path;
+		path << "./trace." << std::dec << tid << ".bin";
+
+		stream->FD = open(path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (stream->FD < 0) {
+			std::cerr << "Unable to open trace stream " << path.str() << std::endl;
+			delete stream;
+			return;
+		}
+	}
+
+	PIN_GetLock(&TraceStreamsLock, tid + 1);
+	TraceStreams.insert(stream);
+	PIN_ReleaseLock(&TraceStreamsLock);
+
+	PIN_SetThreadData(TraceStreamKey, stream, tid);
+
+	ThreadTracePacket ttp;
+	ttp.Type = TRACE_PACKET_THREAD_START;
+	ttp.ThreadID = tid;
+	ttp.OSThreadID = PIN_GetTid();
+	ttp.ParentOSThreadID = PIN_GetParentTid();
+
+	// A live reader must hear of a new thread before any segment that
+	// follows its first one, so it is announced under the pipe lock.
+	if (LiveStreamFD >= 0) {
+		PIN_GetLock(&LiveStreamLock, tid + 1);
+		TraceSync(stream);
+		TraceEmit(stream, &ttp, sizeof(ttp));
+		TraceFlushLocked(stream, false);
+		PIN_ReleaseLock(&LiveStreamLock);
+	} else {
+		TraceSync(stream);
+		TraceEmit(stream, &ttp, sizeof(ttp));
+	}
+}
+
+void ThreadFini(THREADID tid, const CONTEXT *ctx, INT32 code, VOID *v)
+{
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (!stream) return;
+
+	ThreadTracePacket ttp;
+	ttp.Type = TRACE_PACKET_THREAD_END;
+	ttp.ThreadID = tid;
+	ttp.OSThreadID = PIN_GetTid();
+	ttp.ParentOSThreadID = PIN_GetParentTid();
+
+	TraceSync(stream);
+	TraceEmit(stream, &ttp, sizeof(ttp));
+
+	PIN_SetThreadData(TraceStreamKey, NULL, tid);
+	TraceCloseStream(stream);
+}
+
+void ThreadJoinEnter(THREADID tid, uint64_t handle)
+{
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (!stream) return;
+
+	stream->PendingJoin = handle;
+	TraceFlushLive(stream);
+}
+
+void ThreadJoinExit(THREADID tid)
+{
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (!stream) return;
+
+	JoinTracePacket jtp;
+	jtp.Type = TRACE_PACKET_THREAD_JOIN;
+	jtp.Handle = stream->PendingJoin;
+
+	TraceSync(stream);
+	TraceEmit(stream, &jtp, sizeof(jtp));
+}
+
+void BarrierEnter(THREADID tid)
+{
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (!stream) return;
+
+	TraceEvent(stream, TRACE_PACKET_BARRIER_ENTER);
+	TraceFlushLive(stream);
+}
+
+void BarrierExit(THREADID tid)
+{
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (stream) TraceEvent(stream, TRACE_PACKET_BARRIER_EXIT);
+}
+
+void FrameStart(THREADID tid)
 {
 	ASSERT(!CurrentFrame, "A frame is already in progress");
 	
@@ -139,30 +403,40 @@ void FrameStart()
 	CurrentFrame->Index = CurrentFrameIndex++;
 	CurrentFrame->Duration = now();
 	
-	if (TraceFile) {
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (stream) {
 		FrameTracePacket ftp;
 		ftp.Type = TRACE_PACKET_FRAME_START;
-		fwrite(&ftp, sizeof(ftp), 1, TraceFile);
+		ftp.ID = CurrentFrame->Index;
+
+		TraceSync(stream);
+		TraceEmit(stream, &ftp, sizeof(ftp));
+		TraceFlushLive(stream);
 	}
 }
 
-void FrameEnd()
+void FrameEnd(THREADID tid)
 {
 	ASSERT(CurrentFrame, "A frame is not in progress");
 	
 	CurrentFrame->Duration = now() - CurrentFrame->Duration;
 	
-	FrameDescriptors.push_back(CurrentFrame);
-	CurrentFrame = NULL;
-	
-	if (TraceFile) {
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (stream) {
 		FrameTracePacket ftp;
 		ftp.Type = TRACE_PACKET_FRAME_END;
-		fwrite(&ftp, sizeof(ftp), 1, TraceFile);
+		ftp.ID = CurrentFrame->Index;
+
+		TraceSync(stream);
+		TraceEmit(stream, &ftp, sizeof(ftp));
+		TraceFlushLive(stream);
 	}
+	
+	FrameDescriptors.push_back(CurrentFrame);
+	CurrentFrame = NULL;
 }
 
-void KernelRoutineEnter(KernelDescriptor *descriptor)
+void KernelRoutineEnter(THREADID tid, KernelDescriptor *descriptor)
 {
 	ASSERT(CurrentFrame, "A frame is not in progress");
 	ASSERT(!CurrentKernel, "A kernel is already in progress");
@@ -170,15 +444,28 @@ void KernelRoutineEnter(KernelDescriptor *descriptor)
 	CurrentKernel = new KernelInvocation(descriptor);
 	CurrentKernel->Duration = now();
 	
-	if (TraceFile) {
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (stream) {
+		if (!descriptor->Described) {
+			TraceDescribe(stream, TRACE_DESCRIPTOR_KERNEL, descriptor->ID, 0, descriptor->Name);
+			descriptor->Described = true;
+		}
+
 		KernelTracePacket ktp;
 		ktp.Type = TRACE_PACKET_KERNEL_START;
 		ktp.ID = CurrentKernel->Descriptor->ID;
-		fwrite(&ktp, sizeof(ktp), 1, TraceFile);
+
+		TraceSync(stream);
+		TraceEmit(stream, &ktp, sizeof(ktp));
+		TraceFlushLive(stream);
 	}
+	
+	// Other threads start a new segment when they next observe the epoch
+	// change, so none of their segments straddle a kernel boundary.
+	__sync_fetch_and_add(&KernelEpoch, 1);
 }
 
-void KernelRoutineExit(KernelDescriptor *descriptor)
+void KernelRoutineExit(THREADID tid, KernelDescriptor *descriptor)
 {
 	ASSERT(CurrentFrame, "A frame is not in progress");
 	ASSERT(CurrentKernel, "A kernel is not in progress");
@@ -186,13 +473,19 @@ void KernelRoutineExit(KernelDescriptor *descriptor)
 	CurrentKernel->Duration = now() - CurrentKernel->Duration;
 	CurrentFrame->KernelInvocations.push_back(CurrentKernel);
 	
-	if (TraceFile) {
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (stream) {
 		KernelTracePacket ktp;
 		ktp.Type = TRACE_PACKET_KERNEL_END;
 		ktp.ID = CurrentKernel->Descriptor->ID;
-		fwrite(&ktp, sizeof(ktp), 1, TraceFile);
+
+		TraceSync(stream);
+		TraceEmit(stream, &ktp, sizeof(ktp));
+		TraceFlushLive(stream);
 	}
 	
+	__sync_fetch_and_add(&KernelEpoch, 1);
+
 	CurrentKernel->Descriptor->TotalExecutionCount++;
 	CurrentKernel->Descriptor->TotalExecutionTime += CurrentKernel->Duration;
 	CurrentKernel = NULL;	
@@ -285,17 +578,42 @@ void MemoryWriteInstruction(void *rip, uintptr_t addr, MemoryInstruction *mi)
 	MemoryAccessCommon(addr, zone, *mi);
 }
 
-void InstructionExecuted(VOID *rip, uint32_t opcode)
+void InstructionExecuted(THREADID tid, VOID *rip, uint32_t opcode)
 {
 	if (!CurrentKernel) return;
 	
-	if (TraceFile) {
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (stream) {
+		if (stream->KernelEpoch != KernelEpoch || stream->SinceSync >= TRACE_SYNC_INTERVAL)
+			TraceSync(stream);
+
 		InstructionTracePacket itp;
 		itp.Type = TRACE_PACKET_INSTRUCTION;
 		itp.Opcode = opcode;
 		itp.RIP = (uint64_t)rip;
 	
-		fwrite(&itp, sizeof(InstructionTracePacket), 1, TraceFile);
+		TraceEmit(stream, &itp, sizeof(InstructionTracePacket));
+		stream->SinceSync++;
+	}
+}
+
+void MemoryAccessTraced(THREADID tid, VOID *rip, uintptr_t addr, uint32_t size, uint32_t type)
+{
+	if (!CurrentKernel) return;
+
+	ThreadTraceStream *stream = GetTraceStream(tid);
+	if (stream) {
+		if (stream->KernelEpoch != KernelEpoch || stream->SinceSync >= TRACE_SYNC_INTERVAL)
+			TraceSync(stream);
+
+		MemoryTracePacket mtp;
+		mtp.Type = type;
+		mtp.RIP = (uint64_t)rip;
+		mtp.Address = addr;
+		mtp.Size = size;
+
+		TraceEmit(stream, &mtp, sizeof(mtp));
+		stream->SinceSync++;
 	}
 }
 
@@ -308,13 +626,26 @@ void Routine(RTN rtn, VOID *v)
 	if (RTN_Name(rtn) == "FRAME_START") {
 		std::cerr << "Located FRAME_START directive" << std::endl;
 		RTN_Open(rtn);
-		RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)FrameStart, IARG_END);
+		RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)FrameStart, IARG_THREAD_ID, IARG_END);
 		RTN_Close(rtn);
 		return;
 	} else if (RTN_Name(rtn) == "FRAME_END") {
 		std::cerr << "Located FRAME_END directive" << std::endl;
 		RTN_Open(rtn);
-		RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)FrameEnd, IARG_END);
+		RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)FrameEnd, IARG_THREAD_ID, IARG_END);
+		RTN_Close(rtn);
+		return;
+	} else if (RTN_Name(rtn) == "GOMP_barrier" || RTN_Name(rtn) == "__kmpc_barrier") {
+		std::cerr << "Located OpenMP barrier: " << RTN_Name(rtn) << std::endl;
+		RTN_Open(rtn);
+		RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)BarrierEnter, IARG_THREAD_ID, IARG_END);
+		RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)BarrierExit, IARG_THREAD_ID, IARG_END);
+		RTN_Close(rtn);
+		return;
+	} else if (RTN_Name(rtn) == "pthread_join") {
+		RTN_Open(rtn);
+		RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)ThreadJoinEnter, IARG_THREAD_ID, IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+		RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)ThreadJoinExit, IARG_THREAD_ID, IARG_END);
 		RTN_Close(rtn);
 		return;
 	}
@@ -339,11 +670,32 @@ void Routine(RTN rtn, VOID *v)
 	KernelDescriptors.push_back(descriptor);
 	
 	RTN_Open(rtn);
-	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)KernelRoutineEnter, IARG_PTR, descriptor, IARG_END);
-	RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)KernelRoutineExit, IARG_PTR, descriptor, IARG_END);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR)KernelRoutineEnter, IARG_THREAD_ID, IARG_PTR, descriptor, IARG_END);
+	RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR)KernelRoutineExit, IARG_THREAD_ID, IARG_PTR, descriptor, IARG_END);
 	RTN_Close(rtn);
 }
 
+static std::set<uint32_t> DescribedOpcodes, DescribedCategories;
+
+static void DescribeOpcode(INS ins)
+{
+	uint32_t opcode = INS_Opcode(ins);
+	if (DescribedOpcodes.count(opcode)) return;
+
+	// Instrumentation happens on the thread that is about to run the code.
+	ThreadTraceStream *stream = GetTraceStream(PIN_ThreadId());
+	if (!stream) return;
+
+	uint32_t category = INS_Category(ins);
+	if (!DescribedCategories.count(category)) {
+		TraceDescribe(stream, TRACE_DESCRIPTOR_CATEGORY, category, 0, CATEGORY_StringShort(category));
+		DescribedCategories.insert(category);
+	}
+
+	TraceDescribe(stream, TRACE_DESCRIPTOR_OPCODE, opcode, category, OPCODE_StringShort(opcode));
+	DescribedOpcodes.insert(opcode);
+}
+
 void Instruction(INS ins, VOID *p)
 {
 	if (KnobTraceMemory.Value()) {
@@ -365,15 +717,37 @@ void Instruction(INS ins, VOID *p)
 		}
 	}
 	
+	if (KnobTraceKMem.Value()) {
+		unsigned int operand_count = INS_MemoryOperandCount(ins);
+		for (unsigned int operand_index = 0; operand_index < operand_count; operand_index++) {
+			uint32_t size = INS_MemoryOperandSize(ins, operand_index);
+
+			if (INS_MemoryOperandIsRead(ins, operand_index)) {
+				INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryAccessTraced, IARG_THREAD_ID, IARG_INST_PTR, IARG_MEMORYOP_EA, operand_index,
+					IARG_UINT32, size, IARG_UINT32, (uint32_t)TRACE_PACKET_MEMORY_READ, IARG_END);
+			}
+
+			if (INS_MemoryOperandIsWritten(ins, operand_index)) {
+				INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)MemoryAccessTraced, IARG_THREAD_ID, IARG_INST_PTR, IARG_MEMORYOP_EA, operand_index,
+					IARG_UINT32, size, IARG_UINT32, (uint32_t)TRACE_PACKET_MEMORY_WRITE, IARG_END);
+			}
+		}
+	}
+
 	if (KnobTraceKInst.Value()) {
-		INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)InstructionExecuted, IARG_INST_PTR, IARG_PTR, (uint64_t)INS_Opcode(ins), IARG_END);
+		DescribeOpcode(ins);
+		INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)InstructionExecuted, IARG_THREAD_ID, IARG_INST_PTR, IARG_PTR, (uint64_t)INS_Opcode(ins), IARG_END);
 	}
 }
 
 void Fini(INT32 code, void *v)
 {
-	if (TraceFile)
-		fclose(TraceFile);
+	// Streams of threads that are still running at exit are never finalised
+	while (!TraceStreams.empty()) {
+		TraceCloseStream(*TraceStreams.begin());
+	}
+
+	if (LiveStreamFD >= 0) close(LiveStreamFD);
 	
 	std::cerr << std::endl;
 	std::cerr << "*** SLAMBench Completed ***" << std::endl;
@@ -619,8 +993,23 @@ int main(int argc, char *argv[])
 	RTN_AddInstrumentFunction(Routine, NULL);	
 	INS_AddInstrumentFunction(Instruction, NULL);
 	
-	if (KnobTraceKInst.Value()) {
-		TraceFile = fopen("./trace.bin", "wb");
+	if (TraceEnabled()) {
+		TraceStreamKey = PIN_CreateThreadDataKey(NULL);
+		PIN_InitLock(&TraceStreamsLock);
+		PIN_InitLock(&LiveStreamLock);
+
+		if (!KnobTraceStream.Value().empty()) {
+			// Opening a named pipe waits here until the deducer is reading it.
+			std::cerr << "Opening live trace stream " << KnobTraceStream.Value() << std::endl;
+			LiveStreamFD = open(KnobTraceStream.Value().c_str(), O_WRONLY | O_CREAT, 0644);
+			if (LiveStreamFD < 0) {
+				std::cerr << "Unable to open live trace stream " << KnobTraceStream.Value() << std::endl;
+				return 1;
+			}
+		}
+		
+		PIN_AddThreadStartFunction(ThreadStart, NULL);
+		PIN_AddThreadFiniFunction(ThreadFini, NULL);
 	}
 	
 	PIN_AddFiniFunction(Fini, NULL);
@@ -0,0 +1,405 @@
+#ifndef CACHE_CONFIG_H
+#define CACHE_CONFIG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+
+extern "C" {
+#include <d4.h>
+}
+
+/*
+ * Cache hierarchies are described in a small text file, so the same
+ * descriptions can be used online by SBPT-CACHE and offline by the deducer.
+ * Each hierarchy is a [name] section, followed by one line per cache level,
+ * listed from the processor outwards:
+ *
+ *   # 32KB 4-way L1D in front of a 1MB 8-way L2
+ *   [baseline]
+ *   l1d size=32k assoc=4 block=64 repl=random walloc=always wback=never
+ *   l2  size=1m  assoc=8 block=64 repl=lru
+ *
+ * Level options are:
+ *
+ *   size=<bytes>        capacity, with an optional k, m or g suffix (required)
+ *   block=<bytes>       block size (required)
+ *   subblock=<bytes>    sub-block size (default: the block size)
+ *   assoc=<ways>        associativity (default: 1)
+ *   repl=lru|fifo|random
+ *   prefetch=demand|always|miss|tagged|loadforward|subblock
+ *   pfdist=<subblocks>  prefetch distance (default: 1)
+ *   pfabort=<percent>   prefetch abort percentage (default: 0)
+ *   walloc=always|never|nofetch
+ *   wback=always|never|nofetch
+ *   ccc=on|off          classify misses as compulsory, capacity or conflict
+ *                       (default: on)
+ *   layout=auto|array|stack
+ *                       how Dinero IV stores each set; the array layout is
+ *                       faster and gives the same results, but is limited to
+ *                       D4_ARRAY_MAXASSOC ways (default: auto, array if possible)
+ */
+
+struct CacheLevelConfig
+{
+	CacheLevelConfig() : Size(0), BlockSize(0), SubblockSize(0), Assoc(1),
+		Replacement("lru"), Prefetch("demand"), PrefetchDistance(1), PrefetchAbort(0),
+		WriteAlloc("always"), WriteBack("always"), Classify(true), Layout("auto") { }
+
+	std::string Name;
+	uint64_t Size, BlockSize, SubblockSize, Assoc;
+	std::string Replacement, Prefetch;
+	unsigned int PrefetchDistance, PrefetchAbort;
+	std::string WriteAlloc, WriteBack;
+	bool Classify;
+	std::string Layout;
+};
+
+struct CacheConfig
+{
+	std::string Name;
+	std::vector<CacheLevelConfig> Levels;
+};
+
+static inline bool CacheConfigSize(const std::string& value, uint64_t& size)
+{
+	char *end;
+	size = strtoull(value.c_str(), &end, 0);
+
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; end++; break;
+	case 'm': case 'M': size <<= 20; end++; break;
+	case 'g': case 'G': size <<= 30; end++; break;
+	}
+
+	return end != value.c_str() && *end == '\0';
+}
+
+static inline int CacheConfigLog2(uint64_t value)
+{
+	if (value == 0 || (value & (value - 1))) return -1;
+	return __builtin_ctzll(value);
+}
+
+static inline bool CacheConfigOption(CacheLevelConfig& level, const std::string& key, const std::string& value)
+{
+	uint64_t number;
+
+	if (key == "size") {
+		return CacheConfigSize(value, level.Size);
+	} else if (key == "block") {
+		return CacheConfigSize(value, level.BlockSize);
+	} else if (key == "subblock") {
+		return CacheConfigSize(value, level.SubblockSize);
+	} else if (key == "assoc") {
+		return CacheConfigSize(value, level.Assoc);
+	} else if (key == "pfdist") {
+		if (!CacheConfigSize(value, number)) return false;
+		level.PrefetchDistance = number;
+	} else if (key == "pfabort") {
+		if (!CacheConfigSize(value, number) || number > 100) return false;
+		level.PrefetchAbort = number;
+	} else if (key == "repl") {
+		level.Replacement = value;
+		return value == "lru" || value == "fifo" || value == "random";
+	} else if (key == "prefetch") {
+		level.Prefetch = value;
+		return value == "demand" || value == "always" || value == "miss" || value == "tagged" || value == "loadforward" || value == "subblock";
+	} else if (key == "walloc") {
+		level.WriteAlloc = value;
+		return value == "always" || value == "never" || value == "nofetch";
+	} else if (key == "wback") {
+		level.WriteBack = value;
+		return value == "always" || value == "never" || value == "nofetch";
+	} else if (key == "ccc") {
+		level.Classify = value == "on";
+		return value == "on" || value == "off";
+	} else if (key == "layout") {
+		level.Layout = value;
+		return value == "auto" || value == "array" || value == "stack";
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+/* Checks a level for things Dinero IV would only reject in d4setup() */
+static inline const char *CacheConfigValidate(CacheLevelConfig& level)
+{
+	if (!level.SubblockSize) level.SubblockSize = level.BlockSize;
+
+	if (CacheConfigLog2(level.Size) < 0) return "size must be a power of two";
+	if (CacheConfigLog2(level.BlockSize) < 0) return "block size must be a power of two";
+	if (CacheConfigLog2(level.SubblockSize) < 0) return "sub-block size must be a power of two";
+	if (level.SubblockSize > level.BlockSize) return "sub-block size is larger than the block size";
+	if (level.Assoc == 0) return "associativity must be at least one";
+	if (level.Layout == "array" && level.Assoc > D4_ARRAY_MAXASSOC) return "associativity is too large for the array layout";
+	if (level.BlockSize * level.Assoc > level.Size) return "size is smaller than one set";
+	if (CacheConfigLog2(level.Size / (level.BlockSize * level.Assoc)) < 0) return "number of sets must be a power of two";
+
+	return NULL;
+}
+
+/*
+ * Reads every hierarchy in a configuration file.  On failure, error describes
+ * what was wrong and where.
+ */
+static inline bool LoadCacheConfigs(const char *path, std::vector<CacheConfig>& configs, std::string& error)
+{
+	std::ifstream file(path);
+	if (!file) {
+		error = std::string("unable to open cache configuration: ") + path;
+		return false;
+	}
+
+	std::string line;
+	int line_number = 0;
+	while (std::getline(file, line)) {
+		line_number++;
+
+		std::stringstream where;
+		where << path << ":" << line_number << ": ";
+
+		size_t comment = line.find('#');
+		if (comment != std::string::npos) line.erase(comment);
+
+		std::stringstream words(line);
+		std::string word;
+		if (!(words >> word)) continue;
+
+		if (word[0] == '[') {
+			if (word[word.size() - 1] != ']' || word.size() < 3) {
+				error = where.str() + "malformed section name: " + word;
+				return false;
+			}
+
+			CacheConfig config;
+			config.Name = word.substr(1, word.size() - 2);
+			configs.push_back(config);
+			continue;
+		}
+
+		if (configs.empty()) {
+			error = where.str() + "cache level outside of a [section]";
+			return false;
+		}
+
+		CacheLevelConfig level;
+		level.Name = word;
+
+		while (words >> word) {
+			size_t equals = word.find('=');
+			if (equals == std::string::npos || !CacheConfigOption(level, word.substr(0, equals), word.substr(equals + 1))) {
+				error = where.str() + "invalid option: " + word;
+				return false;
+			}
+		}
+
+		const char *invalid = CacheConfigValidate(level);
+		if (invalid) {
+			error = where.str() + level.Name + ": " + invalid;
+			return false;
+		}
+
+		configs.back().Levels.push_back(level);
+	}
+
+	for (const auto& config : configs) {
+		if (config.Levels.empty()) {
+			error = std::string(path) + ": [" + config.Name + "] has no cache levels";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Creates and sets up the Dinero IV caches for a hierarchy, returning them
+ * processor side first.  Each hierarchy gets a context of its own, so
+ * different hierarchies can be simulated on different threads.  Returns the
+ * d4setupin() error, or zero on success.
+ */
+static inline int BuildCacheHierarchy(const CacheConfig& config, std::vector<d4cache *>& levels)
+{
+	d4context *context = d4newcontext();
+	if (!context) return -1;
+
+	d4cache *mem = d4newin(context, NULL);
+	mem->name = strdup((config.Name + " memory").c_str());
+
+	levels.assign(config.Levels.size(), NULL);
+
+	d4cache *parent = mem;
+	for (size_t i = config.Levels.size(); i-- > 0;) {
+		const CacheLevelConfig& level = config.Levels[i];
+
+		d4cache *c = d4new(parent);
+		c->name = strdup((config.Name + " " + level.Name).c_str());
+		c->flags = level.Classify ? D4F_CCC : 0;
+		if (level.Layout == "array" || (level.Layout == "auto" && level.Assoc <= D4_ARRAY_MAXASSOC))
+			c->flags |= D4F_ARRAY;
+
+		c->lg2blocksize = CacheConfigLog2(level.BlockSize);
+		c->lg2subblocksize = CacheConfigLog2(level.SubblockSize);
+		c->lg2size = CacheConfigLog2(level.Size);
+		c->assoc = level.Assoc;
+
+		if (level.Replacement == "fifo") {
+			c->replacementf = d4rep_fifo;
+			c->name_replacement = (char *)"FIFO";
+		} else if (level.Replacement == "random") {
+			c->replacementf = d4rep_random;
+			c->name_replacement = (char *)"random";
+		} else {
+			c->replacementf = d4rep_lru;
+			c->name_replacement = (char *)"LRU";
+		}
+
+		if (level.Prefetch == "always") {
+			c->prefetchf = d4prefetch_always;
+			c->name_prefetch = (char *)"always";
+		} else if (level.Prefetch == "miss") {
+			c->prefetchf = d4prefetch_miss;
+			c->name_prefetch = (char *)"miss";
+		} else if (level.Prefetch == "tagged") {
+			c->prefetchf = d4prefetch_tagged;
+			c->name_prefetch = (char *)"tagged";
+		} else if (level.Prefetch == "loadforward") {
+			c->prefetchf = d4prefetch_loadforw;
+			c->name_prefetch = (char *)"load forward";
+		} else if (level.Prefetch == "subblock") {
+			c->prefetchf = d4prefetch_subblock;
+			c->name_prefetch = (char *)"subblock";
+		} else {
+			c->prefetchf = d4prefetch_none;
+			c->name_prefetch = (char *)"demand only";
+		}
+
+		if (level.WriteAlloc == "never") {
+			c->wallocf = d4walloc_never;
+			c->name_walloc = (char *)"never";
+		} else if (level.WriteAlloc == "nofetch") {
+			c->wallocf = d4walloc_nofetch;
+			c->name_walloc = (char *)"nofetch";
+		} else {
+			c->wallocf = d4walloc_always;
+			c->name_walloc = (char *)"always";
+		}
+
+		if (level.WriteBack == "never") {
+			c->wbackf = d4wback_never;
+			c->name_wback = (char *)"never";
+		} else if (level.WriteBack == "nofetch") {
+			c->wbackf = d4wback_nofetch;
+			c->name_wback = (char *)"nofetch";
+		} else {
+			c->wbackf = d4wback_always;
+			c->name_wback = (char *)"always";
+		}
+
+		c->prefetch_distance = level.PrefetchDistance * level.SubblockSize;
+		c->prefetch_abortpercent = level.PrefetchAbort;
+
+		levels[i] = c;
+		parent = c;
+	}
+
+	return d4setupin(context);
+}
+
+/*
+ * Every counter Dinero IV keeps for one cache.  Counters only ever increase,
+ * so the figures for an interval, such as a kernel invocation, are the
+ * difference between snapshots taken at either end of it.  Each array has
+ * the demand counts for every access type, followed by the prefetch counts.
+ */
+#define CACHE_SNAPSHOT_TYPES	(2 * D4NUMACCESSTYPES)
+
+struct CacheSnapshot
+{
+	CacheSnapshot() { memset(this, 0, sizeof(*this)); }
+
+	double Fetch[CACHE_SNAPSHOT_TYPES], Miss[CACHE_SNAPSHOT_TYPES], BlockMiss[CACHE_SNAPSHOT_TYPES];
+	double CompMiss[CACHE_SNAPSHOT_TYPES], CapMiss[CACHE_SNAPSHOT_TYPES], ConfMiss[CACHE_SNAPSHOT_TYPES];
+	double MultiBlock, BytesRead, BytesWritten;
+
+	void Take(const d4cache *c)
+	{
+		memcpy(Fetch, c->fetch, sizeof(Fetch));
+		memcpy(Miss, c->miss, sizeof(Miss));
+		memcpy(BlockMiss, c->blockmiss, sizeof(BlockMiss));
+		memcpy(CompMiss, c->comp_miss, sizeof(CompMiss));
+		memcpy(CapMiss, c->cap_miss, sizeof(CapMiss));
+		memcpy(ConfMiss, c->conf_miss, sizeof(ConfMiss));
+		MultiBlock = c->multiblock;
+		BytesRead = c->bytes_read;
+		BytesWritten = c->bytes_written;
+	}
+
+	/* Adds on everything that happened between two snapshots of a cache */
+	void Accumulate(const CacheSnapshot& start, const CacheSnapshot& end)
+	{
+		for (int i = 0; i < CACHE_SNAPSHOT_TYPES; i++) {
+			Fetch[i] += end.Fetch[i] - start.Fetch[i];
+			Miss[i] += end.Miss[i] - start.Miss[i];
+			BlockMiss[i] += end.BlockMiss[i] - start.BlockMiss[i];
+			CompMiss[i] += end.CompMiss[i] - start.CompMiss[i];
+			CapMiss[i] += end.CapMiss[i] - start.CapMiss[i];
+			ConfMiss[i] += end.ConfMiss[i] - start.ConfMiss[i];
+		}
+
+		MultiBlock += end.MultiBlock - start.MultiBlock;
+		BytesRead += end.BytesRead - start.BytesRead;
+		BytesWritten += end.BytesWritten - start.BytesWritten;
+	}
+
+	/* Sums a counter over the demand access types, or over the prefetch types */
+	static uint64_t Total(const double *counter, bool prefetch = false)
+	{
+		double total = 0;
+		for (int i = 0; i < D4NUMACCESSTYPES; i++)
+			total += counter[i + (prefetch ? D4PREFETCH : 0)];
+		return total;
+	}
+};
+
+/* Takes a snapshot of every level of a hierarchy, with memory last */
+static inline void SnapshotCacheHierarchy(const std::vector<d4cache *>& levels, std::vector<CacheSnapshot>& snapshots)
+{
+	snapshots.resize(levels.size() + 1);
+
+	for (size_t i = 0; i < levels.size(); i++)
+		snapshots[i].Take(levels[i]);
+
+	snapshots[levels.size()].Take(levels.back()->downstream);
+}
+
+#define CACHE_REPORT_HEADER	"config,kernel,level,raccesses,rhits,rmisses,waccesses,whits,wmisses," \
+				"blockmisses,compulsory,capacity,conflict,multiblock,bytesread,byteswritten,prefetches,prefetchmisses"
+
+/* Prints a line of CACHE_REPORT_HEADER for every level of a hierarchy, memory last */
+static inline void PrintCacheReport(FILE *f, const CacheConfig& config, const std::string& kernel, const std::vector<CacheSnapshot>& levels)
+{
+	for (size_t i = 0; i < levels.size(); i++) {
+		const CacheSnapshot& c = levels[i];
+
+		uint64_t raccesses = c.Fetch[D4XREAD], rmisses = c.Miss[D4XREAD];
+		uint64_t waccesses = c.Fetch[D4XWRITE], wmisses = c.Miss[D4XWRITE];
+
+		fprintf(f, "%s,%s,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", config.Name.c_str(), kernel.c_str(),
+			i < config.Levels.size() ? config.Levels[i].Name.c_str() : "memory",
+			raccesses, raccesses - rmisses, rmisses, waccesses, waccesses - wmisses, wmisses,
+			CacheSnapshot::Total(c.BlockMiss), CacheSnapshot::Total(c.CompMiss), CacheSnapshot::Total(c.CapMiss), CacheSnapshot::Total(c.ConfMiss),
+			(uint64_t)c.MultiBlock, (uint64_t)c.BytesRead, (uint64_t)c.BytesWritten,
+			CacheSnapshot::Total(c.Fetch, true), CacheSnapshot::Total(c.Miss, true));
+	}
+}
+
+#endif /* CACHE_CONFIG_H */
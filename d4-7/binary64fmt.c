@@ -0,0 +1,121 @@
+/*
+ * 64-bit binary input format handling for Dinero IV.
+ *
+ * Copyright (C) 1997 NEC Research Institute, Inc. and Mark D. Hill.
+ * All rights reserved.
+ * Copyright (C) 1985, 1989 Mark D. Hill.  All rights reserved.
+ * 
+ * Permission to use, copy, modify, and distribute this software and
+ * its associated documentation for non-commercial purposes is hereby
+ * granted (for commercial purposes see below), provided that the above
+ * copyright notice appears in all copies, derivative works or modified
+ * versions of the software and any portions thereof, and that both the
+ * copyright notice and this permission notice appear in the documentation.
+ * NEC Research Institute Inc. and Mark D. Hill shall be given a copy of
+ * any such derivative work or modified version of the software and NEC
+ * Research Institute Inc.  and any of its affiliated companies (collectively
+ * referred to as NECI) and Mark D. Hill shall be granted permission to use,
+ * copy, modify, and distribute the software for internal use and research.
+ * The name of NEC Research Institute Inc. and its affiliated companies
+ * shall not be used in advertising or publicity related to the distribution
+ * of the software, without the prior written consent of NECI.  All copies,
+ * derivative works, or modified versions of the software shall be exported
+ * or reexported in accordance with applicable laws and regulations relating
+ * to export control.  This software is experimental.  NECI and Mark D. Hill
+ * make no representations regarding the suitability of this software for
+ * any purpose and neither NECI nor Mark D. Hill will support the software.
+ * 
+ * Use of this software for commercial purposes is also possible, but only
+ * if, in addition to the above requirements for non-commercial use, written
+ * permission for such use is obtained by the commercial user from NECI or
+ * Mark D. Hill prior to the fabrication and distribution of the software.
+ * 
+ * THE SOFTWARE IS PROVIDED AS IS.  NECI AND MARK D. HILL DO NOT MAKE
+ * ANY WARRANTEES EITHER EXPRESS OR IMPLIED WITH REGARD TO THE SOFTWARE.
+ * NECI AND MARK D. HILL ALSO DISCLAIM ANY WARRANTY THAT THE SOFTWARE IS
+ * FREE OF INFRINGEMENT OF ANY INTELLECTUAL PROPERTY RIGHTS OF OTHERS.
+ * NO OTHER LICENSE EXPRESS OR IMPLIED IS HEREBY GRANTED.  NECI AND MARK
+ * D. HILL SHALL NOT BE LIABLE FOR ANY DAMAGES, INCLUDING GENERAL, SPECIAL,
+ * INCIDENTAL, OR CONSEQUENTIAL DAMAGES, ARISING OUT OF THE USE OR INABILITY
+ * TO USE THE SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include "d4.h"
+#include "cmdd4.h"
+#include "tracein.h"
+
+
+/*
+ * This format is the same as the "b" binary format, except that addresses
+ * are 8 bytes, so 64-bit address traces can be simulated without truncation.
+ * Each record is 12 bytes: a little-endian 8-byte address,
+ * followed by a 2-byte little-endian size, a 1-byte access type, and a byte of padding.
+ * Traces are typically large, so the input is read in big blocks.
+ */
+
+#define RECORD_SIZE 12
+#define RECORD_COUNT 65536
+
+#if CHAR_BIT != 8
+#error "binary format code assumes 8 bit chars"
+#endif
+
+d4memref
+tracein_binary64()
+{
+	static unsigned char inbuf[RECORD_SIZE*RECORD_COUNT];
+	static int hiwater = 0;
+	static int inptr = 0;
+	static double nrecords = 0;
+	unsigned long long addr;
+	d4memref r;
+	int i;
+
+	if (inptr > hiwater - RECORD_SIZE) {	/* need to fill inbuf */
+		int nread;
+		if (hiwater > inptr) {
+			memmove (inbuf, &inbuf[inptr], hiwater-inptr);
+			inptr = hiwater - inptr;
+		}
+		else
+			inptr = 0;
+		do {
+			nread = read (0, &inbuf[inptr], sizeof(inbuf) - inptr);
+			if (nread < 0 && errno != EINTR)
+				die ("binary64 input error: %s\n", strerror (errno));
+			if (nread > 0)
+				inptr += nread;
+		} while (inptr < RECORD_SIZE && nread != 0);
+		if (inptr < RECORD_SIZE) {
+			if (inptr > 0)
+				die ("binary64 input error: truncated record %.0f\n", nrecords);
+			r.accesstype = D4TRACE_END;
+			r.address = 0;
+			r.size = 0;
+			return r;
+		}
+		hiwater = inptr;
+		inptr = 0;
+	}
+	addr = 0;
+	for (i = 7;  i >= 0;  i--)
+		addr = (addr << CHAR_BIT) | inbuf[inptr+i];
+	r.address = (d4addr) addr;
+	if (r.address != addr)
+		die ("binary64 input error on trace record %.0f: "
+		     "address 0x%llx is too large for d4addr\n", nrecords, addr);
+	inptr += 8;
+	r.size = (inbuf[inptr+0]<<(0*CHAR_BIT)) |
+		 (inbuf[inptr+1]<<(1*CHAR_BIT));
+	inptr += 2;
+	r.accesstype = inbuf[inptr++];
+	inptr++;	/* skip padding */
+	nrecords++;
+	return r;
+}
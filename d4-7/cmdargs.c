@@ -82,6 +82,7 @@ D4_EXT unsigned int level_subblocksize[3][MAX_LEV];
 D4_EXT unsigned int level_size[3][MAX_LEV];
 D4_EXT unsigned int level_assoc[3][MAX_LEV];
 D4_EXT int level_doccc[3][MAX_LEV];
+D4_EXT int level_doarray[3][MAX_LEV];
 D4_EXT int level_replacement[3][MAX_LEV];
 D4_EXT int level_fetch[3][MAX_LEV];
 D4_EXT int level_walloc[3][MAX_LEV];
@@ -220,6 +221,11 @@ struct arglist args[] = {
 	  "Compulsory/Capacity/Conflict miss statistics",
 	  CUST_MATCH(pmatch_0arg), pval_0arg, CUST_X(pcustom_0arg),
 	  psummary_0arg, CUST_X(phelp_0arg) },
+	{ "array", 5, &level_doarray[0][0], NULL,
+	  "level_doarray",
+	  "Array-based set layout (faster; associativity <= 32)",
+	  CUST_MATCH(pmatch_0arg), pval_0arg, CUST_X(pcustom_0arg),
+	  psummary_0arg, CUST_X(phelp_0arg) },
 	{ "-skipcount", 2, &skipcount, NULL,
 	  NULL,
 	  "Skip initial U references",
@@ -403,7 +409,8 @@ verify_options()
 				      (level_fetch[idu][lev]!=0) +
 				      (level_walloc[idu][lev]!=0) +	/* only for u or d */
 				      (level_wback[idu][lev]!=0);	/* only for u or d */
-			int active = nparams != 0 || level_doccc[idu][lev] != 0;
+			int active = nparams != 0 || level_doccc[idu][lev] != 0 ||
+				     level_doarray[idu][lev] != 0;
 			nidu += active;
 			if (active && nparams != (6+2*(idu!=1))) {
 				if (level_blocksize[idu][lev]==0)
@@ -545,7 +552,8 @@ verify_options()
 			  level_fetch[0][lev]        | 
 			  level_walloc[0][lev]       |
 			  level_wback[0][lev]        |
-			  level_doccc[0][lev]         ) &&
+			  level_doccc[0][lev]        |
+			  level_doarray[0][lev]       ) &&
 		    0 != (level_blocksize[1][lev]    | level_blocksize[2][lev]    |
 			  level_subblocksize[1][lev] | level_subblocksize[2][lev] |
 			  level_size[1][lev]         | level_size[2][lev]         |
@@ -554,7 +562,8 @@ verify_options()
 			  level_fetch[1][lev]        | level_fetch[2][lev]        |
 			  level_walloc[1][lev]       | level_walloc[2][lev]       |
 			  level_wback[1][lev]        | level_wback[2][lev]        |
-			  level_doccc[1][lev]        | level_doccc[2][lev]         ))
+			  level_doccc[1][lev]        | level_doccc[2][lev]        |
+			  level_doarray[1][lev]      | level_doarray[2][lev]       ))
 			shorthelp ("level %d has i or d together with u cache parameters\n",
 				   lev+1);
 	}
@@ -566,6 +575,10 @@ verify_options()
 			    level_blocksize[idu][lev] * level_assoc[idu][lev] > level_size[idu][lev])
 				shorthelp ("level %d %ccache size < blocksize * associativity\n",
 					   lev+1, idu==0?'u':(idu==1?'i':'d'));
+			if (level_doarray[idu][lev] != 0 &&
+			    level_assoc[idu][lev] > D4_ARRAY_MAXASSOC)
+				shorthelp ("level %d %ccache must have associativity <= %d for array layout\n",
+					   lev+1, idu==0?'u':(idu==1?'i':'d'), D4_ARRAY_MAXASSOC);
 		}
 	}
 
@@ -591,6 +604,7 @@ init_1cache (d4cache *c, int lev, int idu)
 	sprintf (c->name, "l%d-%ccache", lev+1, idu==0?'u':(idu==1?'i':'d'));
 
 	c->flags |= level_doccc[idu][lev] ? D4F_CCC : 0;
+	c->flags |= level_doarray[idu][lev] ? D4F_ARRAY : 0;
 	if (idu == 1)
 		c->flags |= D4F_RO;
 	c->lg2blocksize = clog2 (level_blocksize[idu][lev]);
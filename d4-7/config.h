@@ -20,5 +20,11 @@
 /* The number of bytes in a short.  */
 #define SIZEOF_SHORT 2
 
+/* The number of bytes in a long.  */
+#define SIZEOF_LONG 8
+
+/* The number of bytes in a void *.  */
+#define SIZEOF_VOIDP 8
+
 /* type for random, if not defined in stdlib.h */
 /* #undef D4_RANDOM_DEF */
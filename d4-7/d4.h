@@ -149,6 +149,7 @@ typedef struct d4_stacknode_struct {
 typedef struct d4_stackhead_struct {
 	d4stacknode *top;	/* the "beginning" of the stack */
 	int n;			/* size of stack (== 1 + assoc) */
+				/* (for D4F_ARRAY sets, the ways and assoc) */
 } d4stackhead;
 
 
@@ -156,7 +157,7 @@ typedef struct d4_stackhead_struct {
 
 	/*
 	 * Long stacks are indexed with a hash table
-	 * One hash table takes care of everything.
+	 * One hash table takes care of every cache in a context.
 	 * The hash key is based on the block address, stack number,
 	 * and cacheid.  Collisions are resolved by chaining.
 	 */
@@ -166,8 +167,8 @@ struct d4_stackhash_struct {
 };
 
 #define D4HASH_THRESH	8	/* stacks bigger than this size are hashed */
-#define D4HASH(ba,sn,cid)	(((unsigned long)(ba)+(sn)+(cid)) %				\
-				 ((D4_HASHSIZE>0) ? D4_HASHSIZE : d4stackhash.size))
+#define D4HASH(ba,sn,c)	(((unsigned long)(ba)+(sn)+(c)->cacheid) %			\
+				 ((D4_HASHSIZE>0) ? D4_HASHSIZE : (c)->context->stackhash.size))
 #ifndef D4_HASHSIZE
 #define D4_HASHSIZE 0	/* default is automatic */
 #endif
@@ -194,6 +195,30 @@ typedef struct {
 
 
 
+	/*
+	 * Everything shared between caches lives in a context.
+	 * Caches in different contexts have nothing in common,
+	 * so each context may be simulated by a different thread.
+	 * Programs that don't care just use the default context.
+	 */
+typedef struct d4_context_struct {
+	struct d4_cache_struct *allcaches; /* linked list of its caches */
+	int nextcacheid;		/* cacheids are unique within a context */
+	int nnodes;			/* total number of stack nodes allocated */
+	struct d4_stackhash_struct stackhash; /* hash table for its caches */
+	d4pendstack *pendfree;		/* free list for pending mrefs */
+	int totranges;			/* infinite cache ranges allocated */
+	int totbitmaps;
+
+	d4memref *batchbuf[2];		/* queues for d4refbatch */
+	int batchsize[2];
+	d4memref *batchq;		/* the one being filled */
+	int batchn, batchmax;
+} d4context;
+
+
+
+
 	/*
 	 * full specification of a cache
 	 */
@@ -203,7 +228,8 @@ typedef struct d4_cache_struct {
 	int flags;
 	d4stackhead *stack;	/* the priority stacks for this cache */
 	d4pendstack *pending;	/* stack for prefetch etc. */
-	struct d4_cache_struct *link; /* linked list of all caches */
+	struct d4_cache_struct *link; /* linked list of all caches in the context */
+	d4context *context;
 
 	/*
 	 * Cache parameters
@@ -244,6 +270,7 @@ typedef struct d4_cache_struct {
 
 	int		prefetch_distance;	/* specific to built-in prefetch policies */
 	int		prefetch_abortpercent;
+	unsigned int	random_state;		/* for d4random; 0 seeds from cacheid */
 	char		*name_replacement;	/* for printing */
 	char		*name_prefetch;
 	char		*name_walloc;
@@ -259,6 +286,16 @@ typedef struct d4_cache_struct {
 	int		nranges;
 	int		maxranges;
 	d4range		*ranges;
+
+	/*
+	 * Array-based set layout (D4F_ARRAY).
+	 * The stack for each set is replaced by assoc contiguous nodes,
+	 * one per way; the stacks are still used for CCC classification.
+	 */
+	d4addr		*tags;		/* block address of each way */
+	unsigned int	*inuse;		/* bit for each valid way, per set */
+	unsigned char	*ages;		/* depth of each way in the priority stack */
+	d4stacknode	victim;		/* block displaced by the latest miss */
 	
 
 	/*
@@ -286,7 +323,11 @@ typedef struct d4_cache_struct {
 #define D4F_MEM			0x1	/* for simulated memory only */
 #define D4F_CCC			0x2	/* compulsory/capacity/conflict classification */
 #define D4F_RO			0x4	/* cache is read-only (e.g., an instruction cache) */
-#define D4F_USERFLAG1		0x8	/* first available flag bit */
+#define D4F_ARRAY		0x8	/* array-based set layout, see d4_arrayfind */
+#define D4F_USERFLAG1		0x10	/* first available flag bit */
+
+/* largest associativity supported by D4F_ARRAY */
+#define D4_ARRAY_MAXASSOC	32
 
 
 
@@ -383,9 +424,7 @@ typedef struct d4_cache_struct {
  */
 
 extern const int d4custom; /* how to tell if this program was customized */
-extern struct d4_stackhash_struct d4stackhash; /* hash table for all caches */
-extern d4stacknode d4freelist; /* free list for stack nodes of all caches */
-extern int d4nnodes;	/* total number of stack nodes allocated */
+extern d4context d4_defaultcontext; /* used by d4new and d4setup */
 
 
 
@@ -398,11 +437,15 @@ extern int d4nnodes;	/* total number of stack nodes allocated */
 /* top level user-callable functions */
 extern d4cache	*d4new (d4cache *);
 extern int	d4setup (void);
+extern d4context *d4newcontext (void);
+extern d4cache	*d4newin (d4context *, d4cache *);
+extern int	d4setupin (d4context *);
 #if D4CUSTOM && !defined(d4ref)
 #define		d4ref(c,m) (*(c)->ref)(c,m) /* call customized version */
 #else
 void		d4ref (d4cache *, d4memref); /* call generic version */
 #endif
+void		d4refbatch (d4cache *, const d4memref *, int);
 void		d4copyback (d4cache *, const d4memref *, int);
 void		d4invalidate (d4cache *, const d4memref *, int);
 void		d4customize (FILE *);
@@ -454,8 +497,9 @@ extern void d4init_wback_nofetch (d4cache *);
 
 
 /* Miscellaneous functions users may or may not need */
-extern d4pendstack *d4get_mref(void);	/* allocate struct for pending mref */
-extern void d4put_mref (d4pendstack *);	/* deallocate pending mref */
+extern d4pendstack *d4get_mref (d4cache *);	/* allocate struct for pending mref */
+extern void d4put_mref (d4cache *, d4pendstack *); /* deallocate pending mref */
+extern int d4random (d4cache *);	/* like random(), but per cache */
 extern void d4init_prefetch_generic (d4cache *); /* helper routine for prefetch */
 
 extern d4stacknode *d4findnth (d4cache *, int stacknum, int n);
@@ -474,6 +518,7 @@ extern d4memref d4_splitm (d4cache *, d4memref, d4addr);
 extern void d4_dopending (d4cache *, d4pendstack *);
 extern void d4_unhash (d4cache *c, int stacknum, d4stacknode *);
 extern d4stacknode *d4_find (d4cache *, int stacknum, d4addr blockaddr);
+extern d4stacknode *d4_arrayreplace (d4cache *, int setnumber, d4memref, d4stacknode *);
 extern void d4_wbblock (d4cache *, d4stacknode *, const int);
 extern int d4_ncustom;
 extern long *d4_cust_vals[];
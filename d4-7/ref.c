@@ -82,12 +82,6 @@
 #include "d4.h"
 
 
-/* some systems don't provide a proper declaration for random() */
-#ifdef D4_RANDOM_DEF
-extern D4_RANDOM_DEF random(void);
-#endif
-
-
 /* some silly macros to cope with ## wierdness */
 #define D4_OPT__(cacheid,spec)	D4_OPTS_ ## cacheid ## _ ## spec
 #define D4_OPT_(cacheid,spec)	D4_OPT__(cacheid,spec)
@@ -251,7 +245,7 @@ d4rep_random (d4cache *c, int stacknum, d4memref m, d4stacknode *ptr)
 			d4hash (c, stacknum, ptr);
 		c->stack[stacknum].top = ptr;	/* quicker than d4movetotop */
 		if (ptr->up->valid != 0)	/* set is full */
-			d4movetobot (c, stacknum, d4findnth (c, stacknum, 2 + (random() % setsize)));
+			d4movetobot (c, stacknum, d4findnth (c, stacknum, 2 + (d4random (c) % setsize)));
 	}
 	return ptr;
 }
@@ -282,7 +276,7 @@ d4prefetch_always (d4cache *c, d4memref m, int miss, d4stacknode *stackptr)
 {
 	d4pendstack *pf;
 
-	pf = d4get_mref();
+	pf = d4get_mref (c);
 	pf->m.address = D4ADDR2SUBBLOCK (c, m.address + c->prefetch_distance);
 	pf->m.accesstype = m.accesstype | D4PREFETCH;
 	pf->m.size = 1<<D4VAL(c,lg2subblocksize);
@@ -305,7 +299,7 @@ d4prefetch_loadforw (d4cache *c, d4memref m, int miss, d4stacknode *stackptr)
 	if (D4ADDR2BLOCK(c,m.address+c->prefetch_distance) != D4ADDR2BLOCK(c,m.address))
 		return NULL;
 
-	pf = d4get_mref();
+	pf = d4get_mref (c);
 	pf->m.address = D4ADDR2SUBBLOCK (c, m.address + c->prefetch_distance);
 	pf->m.accesstype = m.accesstype | D4PREFETCH;
 	pf->m.size = 1<<D4VAL(c,lg2subblocksize);
@@ -325,7 +319,7 @@ d4prefetch_subblock (d4cache *c, d4memref m, int miss, d4stacknode *stackptr)
 {
 	d4pendstack *pf;
 
-	pf = d4get_mref();
+	pf = d4get_mref (c);
 	pf->m.address = D4ADDR2SUBBLOCK (c, m.address + c->prefetch_distance);
 	pf->m.accesstype = m.accesstype | D4PREFETCH;
 	pf->m.size = 1<<D4VAL(c,lg2subblocksize);
@@ -351,7 +345,7 @@ d4prefetch_miss (d4cache *c, d4memref m, int miss, d4stacknode *stackptr)
 	if (!miss)
 		return NULL;
 
-	pf = d4get_mref();
+	pf = d4get_mref (c);
 	pf->m.address = D4ADDR2SUBBLOCK (c, m.address + c->prefetch_distance);
 	pf->m.accesstype = m.accesstype | D4PREFETCH;
 	pf->m.size = 1<<D4VAL(c,lg2subblocksize);
@@ -383,7 +377,7 @@ d4prefetch_tagged (d4cache *c, d4memref m, int miss, d4stacknode *stackptr)
 	if (!miss && (sbbits & stackptr->referenced) != 0)
 		return NULL;
 
-	pf = d4get_mref();
+	pf = d4get_mref (c);
 	pf->m.address = D4ADDR2SUBBLOCK (c, m.address + c->prefetch_distance);
 	pf->m.accesstype = m.accesstype | D4PREFETCH;
 	pf->m.size = 1<<D4VAL(c,lg2subblocksize);
@@ -498,7 +492,6 @@ d4infcache (d4cache *c, d4memref m)
 	const int nsb = D4REFNSB (c, m);
 	unsigned int bitoff; /* offset of bit in bitmap */
 	int hi, lo, i, b;
-	static int totranges = 0, totbitmaps = 0;
 
 	bitoff = (sbaddr & (D4_BITMAP_RSIZE-1)) / sbsize;
 
@@ -547,10 +540,10 @@ d4infcache (d4cache *c, d4memref m)
 		if (c->ranges == NULL) {
 			fprintf (stderr, "DineroIV: can't allocate more "
 				 "bitmap pointers for cache %s (%d so far, total %d)\n",
-				 c->name, oldmaxranges, totranges);
+				 c->name, oldmaxranges, c->context->totranges);
 			exit(1);
 		}
-		totranges++;
+		c->context->totranges++;
 	}
 	for (i = c->nranges++ - 1;  i >= 0;  i--) {
 		if (c->ranges[i].addr < sbaddr)
@@ -563,10 +556,10 @@ d4infcache (d4cache *c, d4memref m)
 	if (c->ranges[i+1].bitmap == NULL) {
 		fprintf (stderr, "DineroIV: can't allocate another bitmap "
 			 "(currently %d, total %d, each mapping 0x%x bytes)\n",
-			 c->nranges-1, totbitmaps, D4_BITMAP_RSIZE);
+			 c->nranges-1, c->context->totbitmaps, D4_BITMAP_RSIZE);
 		exit(1);
 	}
-	totbitmaps++;
+	c->context->totbitmaps++;
 	for (b = 0;  b < nsb;  b++, bitoff++)
 		c->ranges[i+1].bitmap[bitoff/CHAR_BIT] |= (1<<(bitoff%CHAR_BIT));
 	return 1; /* we've not seen it before */
@@ -589,7 +582,7 @@ d4_splitm (d4cache *c, d4memref mr, d4addr ba)
 
 	if (ba == D4ADDR2BLOCK (c, mr.address + mr.size - 1))
 		return mr;
-	pf = d4get_mref();
+	pf = d4get_mref (c);
         pf->m.address = ba + bsize;
         pf->m.accesstype = mr.accesstype | D4_MULTIBLOCK;
 	newsize = bsize - (mr.address&bmask);
@@ -641,8 +634,9 @@ d4ref (d4cache *c, d4memref mr)
 	 * Find address in the cache.
 	 * Quickly check for top of stack.
 	 */
-	ptr = c->stack[setnumber].top;
-	if (ptr->blockaddr == blockaddr && ptr->valid != 0)
+	if ((D4VAL (c, flags) & D4F_ARRAY) != 0)
+		ptr = d4_find (c, setnumber, blockaddr);
+	else if ((ptr = c->stack[setnumber].top)->blockaddr == blockaddr && ptr->valid != 0)
 		; /* found it */
 	else if (!D4CUSTOM || D4VAL (c, assoc) > 1)
 		ptr = d4_find (c, setnumber, blockaddr);
@@ -661,10 +655,10 @@ d4ref (d4cache *c, d4memref mr)
 	    (m.accesstype == D4XREAD || m.accesstype == D4XINSTRN)) {
 		d4pendstack *pf = D4VAL (c, prefetchf) (c, m, miss, ptr);
 		if (pf != NULL) {
-			/* Note: 0 <= random() <= 2^31-1 and 0 <= random()/(INT_MAX/100) < 100. */
+			/* Note: 0 <= d4random() <= 2^31-1 and 0 <= d4random()/(INT_MAX/100) < 100. */
 			if (D4VAL (c, prefetch_abortpercent) > 0 &&
-			    random()/(INT_MAX/100) < D4VAL (c, prefetch_abortpercent))
-				d4put_mref (pf);	/* throw it away */
+			    d4random (c)/(INT_MAX/100) < D4VAL (c, prefetch_abortpercent))
+				d4put_mref (c, pf);	/* throw it away */
 			else {
 				pf->next = c->pending;	/* add to pending list */
 				c->pending = pf;
@@ -681,7 +675,10 @@ d4ref (d4cache *c, d4memref mr)
 		/*
 		 * Adjust priority stack as necessary
 		 */
-		ptr = D4VAL (c, replacementf) (c, setnumber, m, ptr);
+		if ((D4VAL (c, flags) & D4F_ARRAY) != 0)
+			ptr = d4_arrayreplace (c, setnumber, m, ptr);
+		else
+			ptr = D4VAL (c, replacementf) (c, setnumber, m, ptr);
 		/*
 		 * Update state bits
 		 */
@@ -709,11 +706,12 @@ d4ref (d4cache *c, d4memref mr)
 		 * including write-back if necessary
 		 */
 		if (blockmiss) {
-			d4stacknode *rptr = c->stack[setnumber].top->up;
+			const int array = (D4VAL (c, flags) & D4F_ARRAY) != 0;
+			d4stacknode *rptr = array ? &c->victim : c->stack[setnumber].top->up;
 			if (rptr->valid != 0) {
 				if (!ronly && (rptr->valid & rptr->dirty) != 0)
 					d4_wbblock (c, rptr, D4VAL (c, lg2subblocksize));
-				if (c->stack[setnumber].n > D4HASH_THRESH)
+				if (!array && c->stack[setnumber].n > D4HASH_THRESH)
 					d4_unhash (c, setnumber, rptr);
 				rptr->valid = 0;
 			}
@@ -729,14 +727,14 @@ d4ref (d4cache *c, d4memref mr)
 	 * a fetch to load the complete subblock and a write-through store.
 	 */
 	if (!ronly && atype == D4XWRITE && !wback) {
-		d4pendstack *newm = d4get_mref();
+		d4pendstack *newm = d4get_mref (c);
 		newm->m = m; 
 		newm->next = c->pending;
 		c->pending = newm;
 	}
 	if (miss && (ronly || atype != D4XWRITE ||
 		     (walloc && m.size != D4REFNSB (c, m) << D4VAL (c, lg2subblocksize)))) {
-		d4pendstack *newm = d4get_mref();
+		d4pendstack *newm = d4get_mref (c);
 		/* note, we drop prefetch attribute */
 		newm->m.accesstype = (atype == D4XWRITE) ? D4XREAD : atype;
 		newm->m.address = D4ADDR2SUBBLOCK (c, m.address);
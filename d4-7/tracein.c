@@ -85,6 +85,9 @@ verify_trace_format()
 	case 'b':				/* binary format, similar to din */
 		  input_function = tracein_binary;
 		  break;
+	case 'B':				/* binary format with 64-bit addresses */
+		  input_function = tracein_binary64;
+		  break;
 	}
 }
 
@@ -93,6 +96,6 @@ verify_trace_format()
 void
 help_trace_format (int indent)
 {
-	printf ("\n %*s (D=extended din, d=traditional din, p=pixie32, P=pixie64,\n %*s b=binary)",
+	printf ("\n %*s (D=extended din, d=traditional din, p=pixie32, P=pixie64,\n %*s b=binary, B=64-bit binary)",
 		indent, " ", indent, " ");
 }
@@ -50,6 +50,7 @@ extern d4memref tracein_din (void);
 extern d4memref tracein_pixie32 (void);
 extern d4memref tracein_pixie64 (void);
 extern d4memref tracein_binary (void);
+extern d4memref tracein_binary64 (void);
 
 /* A pointer to one of the above functions */
 extern d4memref (*input_function) (void);
@@ -47,18 +47,34 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include "d4.h"
 
+/*
+ * The D4F_ARRAY lookup compares 4 tags at a time with AVX2.
+ * With GCC-compatible compilers on x86-64 the vector code is built
+ * whatever the compiler flags, and used if the processor supports it.
+ */
+#if defined(__GNUC__) && defined(__x86_64__)
+#define D4_ARRAY_AVX2 1
+#include <immintrin.h>
+#else
+#define D4_ARRAY_AVX2 0
+#endif
+
+/* D4F_ARRAY ages are updated 8 at a time, so each set's are padded */
+#define D4_ARRAYAGESTRIDE(c)	(((c)->assoc + 7) & ~7)
+#define D4_ARRAYAGES(c,set)	(&(c)->ages[(set) * D4_ARRAYAGESTRIDE (c)])
+
 
 /*
  * Global variable definitions
  */
-struct d4_stackhash_struct d4stackhash;
-d4stacknode d4freelist;
-int d4nnodes;
-d4pendstack *d4pendfree;
-d4cache *d4_allcaches;
+d4context d4_defaultcontext;
+#if D4_ARRAY_AVX2
+static int d4_useavx2;	/* the same for every context */
+#endif
 
 
 /*
@@ -66,30 +82,55 @@ d4cache *d4_allcaches;
  */
 extern void d4_invblock (d4cache *, int stacknum, d4stacknode *);
 extern void d4_invinfcache (d4cache *, const d4memref *);
+extern void d4_arrayinval (d4cache *, int setnumber, int way);
+
+
+/*
+ * Create a new context, for caches that can be simulated
+ * independently of those in any other context.
+ */
+d4context *
+d4newcontext()
+{
+	return calloc (1, sizeof(d4context));
+}
 
 
 /*
  * Create a new cache
  * The new cache sits "above" the indicated larger cache in the
  * memory hierarchy, with memory at the bottom and processors at the top.
+ * A new memory (larger == NULL) goes in the default context,
+ * and every other cache goes in the same context as the larger one.
  */
 d4cache *
 d4new (d4cache *larger)
 {
-	static int nextcacheid = 1;
-	d4cache *c = calloc (1, sizeof(d4cache));
+	return d4newin (larger != NULL ? larger->context : &d4_defaultcontext, larger);
+}
+
 
+/* Create a new cache in the given context */
+d4cache *
+d4newin (d4context *x, d4cache *larger)
+{
+	d4cache *c;
+
+	if (larger != NULL && larger->context != x)
+		return NULL;
+	c = calloc (1, sizeof(d4cache));
 	if (c == NULL)
 		return NULL;
-	c->cacheid = nextcacheid++;
+	c->cacheid = ++x->nextcacheid;
+	c->context = x;
 	c->downstream = larger;
 	c->ref = d4ref;	/* may get altered for custom version */
 	if (larger == NULL) {	/* simulated memory */
 		c->flags = D4F_MEM;
 		c->assoc = 1;	/* not used, but helps avoid compiler warnings */
 	}
-	c->link = d4_allcaches;
-	d4_allcaches = c;	/* d4customize depends on this LIFO order */
+	c->link = x->allcaches;
+	x->allcaches = c;	/* d4customize depends on this LIFO order */
 	return c;
 }
 
@@ -104,20 +145,33 @@ d4new (d4cache *larger)
 int
 d4setup()
 {
-	int i, nnodes;
+	return d4setupin (&d4_defaultcontext);
+}
+
+
+/*
+ * Same as d4setup, for the caches of another context.
+ * Customized programs only support the default context.
+ */
+int
+d4setupin (d4context *x)
+{
+	int i, nnodes, array;
 	int r = 0;
 	d4cache *c, *cc;
 	d4stacknode *nodes = NULL, *ptr;
 
-	for (c = d4_allcaches;  c != NULL;  c = c->link) {
+	for (c = x->allcaches;  c != NULL;  c = c->link) {
 
 		/* Check some stuff the user shouldn't muck with */
 		if (c->stack != NULL || c->pending != NULL ||
-		    c->cacheid < 1 ||
+		    c->cacheid < 1 || c->context != x ||
+		    (d4custom && x != &d4_defaultcontext) ||
 		    (c->link == NULL && c->cacheid != 1) ||
 		    (c->flags != D4F_MEM && c->downstream == NULL) ||
 		    c->numsets != 0 ||
-		    c->ranges != NULL || c->nranges != 0 || c->maxranges != 0)
+		    c->ranges != NULL || c->nranges != 0 || c->maxranges != 0 ||
+		    c->tags != NULL || c->inuse != NULL || c->ages != NULL)
 			goto fail1;
 
 		/*
@@ -183,8 +237,15 @@ d4setup()
 				goto fail4;
 			if (c->assoc <= 0)
 				goto fail5;
+			if ((c->flags & D4F_ARRAY) != 0 && c->assoc > D4_ARRAY_MAXASSOC)
+				goto fail5;
 			if (c->replacementf == NULL || c->name_replacement == NULL)
 				goto fail6;
+			if ((c->flags & D4F_ARRAY) != 0 &&
+			    c->replacementf != d4rep_lru &&
+			    c->replacementf != d4rep_fifo &&
+			    c->replacementf != d4rep_random)
+				goto fail6;
 			if (c->prefetchf == NULL || c->name_prefetch == NULL)
 				goto fail7;
 			if (c->wallocf == NULL || c->name_walloc == NULL)
@@ -196,12 +257,13 @@ d4setup()
 
 			/* it looks ok, now initialize */
 			c->numsets = (1<<c->lg2size) / ((1<<c->lg2blocksize) * c->assoc);
+			array = (c->flags & D4F_ARRAY) != 0;
 
 			c->stack = calloc (c->numsets+((c->flags&D4F_CCC)!=0),
 					   sizeof(d4stackhead));
 			if (c->stack == NULL)
 				goto fail10;
-			nnodes = c->numsets * (1 + c->assoc) +
+			nnodes = c->numsets * (!array + c->assoc) +
 				 (c->numsets * c->assoc + 1) * ((c->flags&D4F_CCC)!=0);
 			nodes = calloc (nnodes, sizeof(d4stacknode));
 			if (nodes == NULL)
@@ -212,6 +274,15 @@ d4setup()
 			/* set up circular list for each stack */
 			for (i = 0;  i < c->numsets+((c->flags&D4F_CCC)!=0);  i++) {
 				int j, n;
+				if (array && i < c->numsets) {
+					/* just the ways, no list */
+					c->stack[i].top = ptr;
+					c->stack[i].n = c->assoc;
+					for (j = 0;  j < c->assoc;  j++)
+						ptr[j].onstack = i;
+					ptr += c->assoc;
+					continue;
+				}
 				n = 1 + c->assoc * ((i < c->numsets) ? 1 : c->numsets);
 				c->stack[i].top = ptr;
 				c->stack[i].n = n;
@@ -229,11 +300,21 @@ d4setup()
 				ptr += n;
 			}
 			assert (ptr - nodes == nnodes);
+			if (array) {
+				/* pad the tags so vector loads stay in bounds */
+				c->tags = calloc (c->numsets * c->assoc + 3, sizeof(d4addr));
+				c->inuse = calloc (c->numsets, sizeof(unsigned int));
+				c->ages = calloc (c->numsets, D4_ARRAYAGESTRIDE (c));
+				if (c->tags == NULL || c->inuse == NULL || c->ages == NULL)
+					goto fail12;
+			}
 #if D4_HASHSIZE == 0
-			d4stackhash.size += c->numsets * c->assoc;
+			x->stackhash.size += c->numsets * c->assoc;
 #endif
-			d4nnodes += nnodes;
+			x->nnodes += nnodes;
 		}
+		if (c->random_state == 0)
+			c->random_state = 0x9e3779b9u * c->cacheid;
 
 		/* make a printable name if the user didn't pick one */
 		if (c->name == NULL) {
@@ -245,10 +326,13 @@ d4setup()
 		}
 	}
 #if D4_HASHSIZE > 0
-	d4stackhash.size = D4_HASHSIZE;
+	x->stackhash.size = D4_HASHSIZE;
+#endif
+#if D4_ARRAY_AVX2
+	d4_useavx2 = sizeof(d4addr) == 8 && __builtin_cpu_supports ("avx2");
 #endif
-	d4stackhash.table = calloc (d4stackhash.size, sizeof(d4stacknode*));
-	if (d4stackhash.table == NULL)
+	x->stackhash.table = calloc (x->stackhash.size, sizeof(d4stacknode*));
+	if (x->stackhash.table == NULL)
 		goto fail13;
 	return 0;
 
@@ -270,14 +354,14 @@ fail3:	r++;
 fail2:	r++;
 fail1:	r++;
 
-	for (cc = d4_allcaches;  cc != c;  cc = cc->link) {
+	for (cc = x->allcaches;  cc != c;  cc = cc->link) {
 		/* don't bother trying to deallocate c->name */
 		free (c->stack[0].top);
 		free (c->stack);
 		c->stack = NULL;
 		c->numsets = 0;
 	}
-	d4nnodes = 0;
+	x->nnodes = 0;
 	return r;
 }
 
@@ -463,6 +547,148 @@ d4checkstack (d4cache *c, int stacknum, char *msg)
 #endif
 
 
+/*
+ * Array-based set layout (D4F_ARRAY).
+ * Each set keeps the block addresses of its ways contiguously in c->tags,
+ * so a lookup is a handful of vector compares instead of a walk down the
+ * stack.  c->ages holds each valid way's depth in the equivalent priority
+ * stack (0 is the top), which is all LRU, FIFO and random replacement need
+ * to choose the same victims as the stacks would.
+ */
+#if D4_ARRAY_AVX2
+__attribute__((target("avx2")))
+static unsigned int
+d4_arraymatch_avx2 (const d4addr *tags, int assoc, d4addr blockaddr)
+{
+	const __m256i key = _mm256_set1_epi64x ((long long) blockaddr);
+	unsigned int match = 0;
+	int i;
+
+	for (i = 0;  i < assoc;  i += 4) {
+		__m256i t = _mm256_loadu_si256 ((const __m256i *) &tags[i]);
+		__m256i eq = _mm256_cmpeq_epi64 (t, key);
+		match |= (unsigned int) _mm256_movemask_pd (_mm256_castsi256_pd (eq)) << i;
+	}
+	return match;
+}
+#endif
+
+
+/* Find address in an array set */
+static d4stacknode *
+d4_arrayfind (d4cache *c, int setnumber, d4addr blockaddr)
+{
+	const int assoc = c->assoc;
+	const d4addr *tags = &c->tags[setnumber * assoc];
+	unsigned int inuse = c->inuse[setnumber];
+	int way;
+
+#if D4_ARRAY_AVX2
+	if (d4_useavx2 && assoc >= 4) {
+		unsigned int match = d4_arraymatch_avx2 (tags, assoc, blockaddr) & inuse;
+		if (match == 0)
+			return NULL;
+		return &c->stack[setnumber].top[__builtin_ctz (match)];
+	}
+#endif
+	for (way = 0;  inuse != 0;  way++, inuse >>= 1)
+		if ((inuse & 1) != 0 && tags[way] == blockaddr)
+			return &c->stack[setnumber].top[way];
+	return NULL;
+}
+
+
+/*
+ * Age every block younger than age by one.
+ * Within each byte, 0x80+age-1-a has its top bit set exactly when a < age,
+ * and ages never exceed D4_ARRAY_MAXASSOC, so no borrow crosses a byte.
+ */
+static void
+d4_arrayage (unsigned char *ages, int assoc, int age)
+{
+	const unsigned long long ones = 0x0101010101010101ULL;
+	const unsigned long long limit = ones * (0x80 + age - 1);
+	unsigned long long a;
+	int way;
+
+	if (age == 0)
+		return;
+	for (way = 0;  way < assoc;  way += 8) {
+		memcpy (&a, &ages[way], sizeof(a));
+		a += ((limit - a) >> 7) & ones;
+		memcpy (&ages[way], &a, sizeof(a));
+	}
+}
+
+
+/*
+ * Replacement for array sets, taking the place of c->replacementf.
+ * On a miss, the state of any block displaced is left in c->victim
+ * for d4ref to write back.
+ */
+d4stacknode *
+d4_arrayreplace (d4cache *c, int setnumber, d4memref m, d4stacknode *ptr)
+{
+	const int assoc = c->assoc;
+	const unsigned int full = (assoc == 32) ? ~0u : (1u << assoc) - 1;
+	d4stacknode *ways = c->stack[setnumber].top;
+	unsigned char *ages = D4_ARRAYAGES (c, setnumber);
+	int way, victim;
+
+	if (ptr != NULL) {	/* hits */
+		way = ptr - ways;
+		if (ages[way] != 0 && c->replacementf == d4rep_lru) {
+			d4_arrayage (ages, assoc, ages[way]);
+			ages[way] = 0;
+		}
+		return ptr;
+	}
+
+	/* misses */
+	c->victim.valid = 0;
+	if (c->inuse[setnumber] != full) {
+		for (way = 0;  (c->inuse[setnumber] >> way) & 1;  way++)
+			continue;
+		victim = assoc;
+	}
+	else {
+		/* the bottom of the stack, or a random depth just like d4rep_random */
+		if (c->replacementf == d4rep_random)
+			victim = d4random (c) % assoc;
+		else
+			victim = assoc - 1;
+		for (way = 0;  ages[way] != victim;  way++)
+			continue;
+		c->victim = ways[way];
+		ways[way].valid = 0;
+	}
+	d4_arrayage (ages, assoc, victim);
+	ages[way] = 0;
+	c->inuse[setnumber] |= 1u << way;
+	ptr = &ways[way];
+	ptr->blockaddr = D4ADDR2BLOCK (c, m.address);
+	c->tags[setnumber * assoc + way] = ptr->blockaddr;
+	return ptr;
+}
+
+
+/* Invalidate one way of an array set */
+void
+d4_arrayinval (d4cache *c, int setnumber, int way)
+{
+	const int assoc = c->assoc;
+	unsigned char *ages = D4_ARRAYAGES (c, setnumber);
+	unsigned int inuse;
+	int i;
+
+	c->stack[setnumber].top[way].valid = 0;
+	inuse = c->inuse[setnumber] &= ~(1u << way);
+	for (i = 0;  i < assoc;  i++)
+		if (((inuse >> i) & 1) != 0 && ages[i] > ages[way])
+			ages[i]--;
+}
+
+
 /*
  * Find address in stack.
  */
@@ -471,9 +697,12 @@ d4_find (d4cache *c, int stacknum, d4addr blockaddr)
 {
 	d4stacknode *ptr;
 
+	if ((c->flags & D4F_ARRAY) != 0 && stacknum < c->numsets)
+		return d4_arrayfind (c, stacknum, blockaddr);
+
 	if (c->stack[stacknum].n > D4HASH_THRESH) {
-		int buck = D4HASH (blockaddr, stacknum, c->cacheid);
-		for (ptr = d4stackhash.table[buck];
+		int buck = D4HASH (blockaddr, stacknum, c);
+		for (ptr = c->context->stackhash.table[buck];
 		     ptr!=NULL && (ptr->blockaddr!=blockaddr || ptr->cachep!=c || ptr->onstack != stacknum);
 		     ptr = ptr->bucket)
 			assert (ptr->valid != 0);
@@ -569,11 +798,11 @@ d4movetobot (d4cache *c, int stacknum, d4stacknode *ptr)
 void
 d4hash (d4cache *c, int stacknum, d4stacknode *s)
 {
-	int buck = D4HASH (s->blockaddr, stacknum, s->cachep->cacheid);
+	int buck = D4HASH (s->blockaddr, stacknum, s->cachep);
 
 	assert (c->stack[stacknum].n > D4HASH_THRESH);
-	s->bucket = d4stackhash.table[buck];
-	d4stackhash.table[buck] = s;
+	s->bucket = c->context->stackhash.table[buck];
+	c->context->stackhash.table[buck] = s;
 }
 
 
@@ -581,12 +810,12 @@ d4hash (d4cache *c, int stacknum, d4stacknode *s)
 void
 d4_unhash (d4cache *c, int stacknum, d4stacknode *s)
 {
-	int buck = D4HASH (s->blockaddr, stacknum, c->cacheid);
-	d4stacknode *p = d4stackhash.table[buck];
+	int buck = D4HASH (s->blockaddr, stacknum, c);
+	d4stacknode *p = c->context->stackhash.table[buck];
 
 	assert (c->stack[stacknum].n > D4HASH_THRESH);
 	if (p == s)
-		d4stackhash.table[buck] = s->bucket;
+		c->context->stackhash.table[buck] = s->bucket;
 	else {
 		while (p->bucket != s) {
 			assert (p->bucket != NULL);
@@ -599,13 +828,13 @@ d4_unhash (d4cache *c, int stacknum, d4stacknode *s)
 
 /* Allocate a structure describing a pending memory reference */
 d4pendstack *
-d4get_mref()
+d4get_mref (d4cache *c)
 {
 	d4pendstack *m;
 
-	m = d4pendfree;
+	m = c->context->pendfree;
 	if (m != NULL) {
-		d4pendfree = m->next;
+		c->context->pendfree = m->next;
 		return m;
 	}
 	m = malloc (sizeof(*m));	/* no need to get too fancy here */
@@ -619,10 +848,27 @@ d4get_mref()
 
 /* Deallocate the structure used to describe a pending memory reference */
 void
-d4put_mref (d4pendstack *m)
+d4put_mref (d4cache *c, d4pendstack *m)
 {
-	m->next = d4pendfree;
-	d4pendfree = m;
+	m->next = c->context->pendfree;
+	c->context->pendfree = m;
+}
+
+
+/*
+ * A fast replacement for random(), with the same range,
+ * keeping separate state in each cache (xorshift).
+ */
+int
+d4random (d4cache *c)
+{
+	unsigned int x = c->random_state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	c->random_state = x;
+	return (int) (x >> 1);
 }
 
 
@@ -658,11 +904,112 @@ d4_dopending (d4cache *c, d4pendstack *newm)
 			}
 			c->downstream->ref (c->downstream, newm->m);
 		}
-		d4put_mref(newm);
+		d4put_mref (c, newm);
 	} while ((newm = c->pending) != NULL);
 }
 
 
+/*
+ * Batched references.
+ * While a batch is run through one cache, the ref function of the cache
+ * below it is replaced by d4_batchqueue, so everything that would be
+ * passed down is queued, in order, instead.  The queue then becomes the
+ * batch for the next cache down.  Each cache sees the same references in
+ * the same order as with one d4ref call per reference, since no cache
+ * depends on the state of those below it.
+ */
+#define D4_BATCH_PREFETCH	8	/* references ahead to prefetch sets for */
+
+#ifdef __GNUC__
+#define D4PREFETCHADDR(p)	__builtin_prefetch (p)
+#else
+#define D4PREFETCHADDR(p)	((void) 0)
+#endif
+
+static void
+d4_batchqueue (d4cache *c, d4memref m)
+{
+	d4context *x = c->context;
+
+	if (x->batchn == x->batchmax) {
+		x->batchmax = x->batchmax ? 2 * x->batchmax : 4096;
+		x->batchq = realloc (x->batchq, x->batchmax * sizeof(d4memref));
+		if (x->batchq == NULL) {
+			fprintf (stderr, "DineroIV ***error: no memory for batched mrefs\n");
+			exit (9);
+		}
+	}
+	x->batchq[x->batchn++] = m;
+}
+
+
+/*
+ * Start loading the part of a cache a reference will need.  Stack sets
+ * take two steps: the stack head early on, then the top node it points to.
+ */
+static void
+d4_prefetchset (d4cache *c, d4addr address, int early)
+{
+	const int setnumber = D4ADDR2SET (c, address);
+
+	if ((c->flags & D4F_ARRAY) != 0) {
+		if (!early) {
+			D4PREFETCHADDR (&c->tags[setnumber * c->assoc]);
+			D4PREFETCHADDR (D4_ARRAYAGES (c, setnumber));
+		}
+	}
+	else if (early)
+		D4PREFETCHADDR (&c->stack[setnumber]);
+	else
+		D4PREFETCHADDR (c->stack[setnumber].top);
+}
+
+
+/*
+ * Handle an array of memory references for the given cache,
+ * with the same results as calling d4ref for each in turn.
+ * Not reentrant within a context.
+ */
+void
+d4refbatch (d4cache *c, const d4memref *refs, int n)
+{
+	d4context *x = c->context;
+	int which = 0;
+
+	while (n > 0) {
+		d4cache *d = c->downstream;
+		void (*dref)(d4cache *, d4memref);
+		int i;
+
+		if ((c->flags & D4F_MEM) != 0) {
+			for (i = 0;  i < n;  i++)
+				c->ref (c, refs[i]);
+			return;
+		}
+		dref = d->ref;
+		d->ref = d4_batchqueue;
+		x->batchq = x->batchbuf[which];
+		x->batchmax = x->batchsize[which];
+		x->batchn = 0;
+		for (i = 0;  i < n;  i++) {
+			if (i + 2 * D4_BATCH_PREFETCH < n)
+				d4_prefetchset (c, refs[i + 2 * D4_BATCH_PREFETCH].address, 1);
+			if (i + D4_BATCH_PREFETCH < n)
+				d4_prefetchset (c, refs[i + D4_BATCH_PREFETCH].address, 0);
+			c->ref (c, refs[i]);
+		}
+		d->ref = dref;
+		x->batchbuf[which] = x->batchq;
+		x->batchsize[which] = x->batchmax;
+
+		c = d;
+		refs = x->batchq;
+		n = x->batchn;
+		which ^= 1;
+	}
+}
+
+
 /*
  * Initiate write back for the dirty parts of a block.
  * Each contiguous bunch of subblocks is written in one operation.
@@ -679,7 +1026,7 @@ d4_wbblock (d4cache *c, d4stacknode *ptr, const int lg2sbsize)
 	dbits = ptr->valid & ptr->dirty;
 	a = ptr->blockaddr;
 	do {
-		newm = d4get_mref();
+		newm = d4get_mref (c);
 		newm->m.accesstype = D4XWRITE;
 		for (;  (dbits&b) == 0;  b<<=1)
 			a += sbsize;
@@ -701,6 +1048,10 @@ void
 d4_invblock (d4cache *c, int stacknum, d4stacknode *ptr)
 {
 	assert (ptr->valid != 0);
+	if ((c->flags & D4F_ARRAY) != 0 && stacknum < c->numsets) {
+		d4_arrayinval (c, stacknum, ptr - c->stack[stacknum].top);
+		return;
+	}
 	ptr->valid = 0;
 	d4movetobot (c, stacknum, ptr);
 	if (c->stack[stacknum].n > D4HASH_THRESH)
@@ -730,7 +1081,7 @@ d4copyback (d4cache *c, const d4memref *m, int prop)
 	if (m != NULL)
 		assert (m->accesstype == D4XCOPYB);
 	if (prop) {
-		newm = d4get_mref();
+		newm = d4get_mref (c);
 		if (m != NULL)
 			newm->m = *m;
 		else {
@@ -748,6 +1099,17 @@ d4copyback (d4cache *c, const d4memref *m, int prop)
 	}
 	else for (stacknum=0;  stacknum < c->numsets;  stacknum++) {
 		d4stacknode *top = c->stack[stacknum].top;
+		if ((c->flags & D4F_ARRAY) != 0) {
+			/* visit the ways in stack order, as below */
+			const unsigned char *ages = D4_ARRAYAGES (c, stacknum);
+			int age, way;
+			for (age = 0;  age < c->assoc;  age++)
+				for (way = 0;  way < c->assoc;  way++)
+					if (((c->inuse[stacknum] >> way) & 1) != 0 && ages[way] == age &&
+					    (top[way].dirty & top[way].valid) != 0)
+						d4_wbblock (c, &top[way], c->lg2subblocksize);
+			continue;
+		}
 		assert (top->up->valid == 0); /* this loop skips the bottom node */
 		for (ptr = top;  ptr->down != top;  ptr = ptr->down)
 			if ((ptr->dirty & ptr->valid) != 0)
@@ -781,7 +1143,7 @@ d4invalidate (d4cache *c, const d4memref *m, int prop)
 	if (m != NULL)
 		assert (m->accesstype == D4XINVAL);
 	if (prop) {
-		newm = d4get_mref();
+		newm = d4get_mref (c);
 		if (m != NULL)
 			newm->m = *m;
 		else {
@@ -804,6 +1166,13 @@ d4invalidate (d4cache *c, const d4memref *m, int prop)
 	}
 	else for (stacknum=0;  stacknum < c->numsets + ((c->flags & D4F_CCC) != 0);  stacknum++) {
 		d4stacknode *top = c->stack[stacknum].top;
+		if ((c->flags & D4F_ARRAY) != 0 && stacknum < c->numsets) {
+			int way;
+			for (way = 0;  way < c->assoc;  way++)
+				top[way].valid = 0;
+			c->inuse[stacknum] = 0;
+			continue;
+		}
 		assert (top->up->valid == 0); /* all invalid nodes are at bottom; at least 1 */
 		for (ptr = top;  ptr->down != top;  ptr = ptr->down) {
 			if (ptr->valid == 0)
@@ -837,7 +1206,7 @@ d4_invinfcache (d4cache *c, const d4memref *m)
 	}
 	else {					/* invalidate just one block */
 		const unsigned int sbsize = 1 << D4VAL (c, lg2subblocksize);
-		const unsigned int baddr = D4ADDR2BLOCK (c, m->address);
+		const d4addr baddr = D4ADDR2BLOCK (c, m->address);
 		unsigned int bitoff;	/* offset of bit in bitmap */
 		int hi, lo, nsb;
 
@@ -889,11 +1258,11 @@ d4customize (FILE *f)
 	 * which can be used to find the proper customized d4ref function
 	 * when the customized program is started up.
 	 */
-	if (d4_allcaches == NULL) {
+	if (d4_defaultcontext.allcaches == NULL) {
 		fprintf (stderr, "Dinero IV: d4customize called before d4new\n");
 		exit (9);
 	}
-	n = d4_allcaches->cacheid;
+	n = d4_defaultcontext.allcaches->cacheid;
 	for (i = 1;  i <= n;  i++)
 		fprintf (f, "extern void d4_%dref (d4cache *, d4memref);\n", i);
 	fprintf (f, "void (*d4_custom[])(d4cache *, d4memref) = {\n\t");
@@ -909,7 +1278,7 @@ d4customize (FILE *f)
 	 * If you add new policy functions to ref.c, you need to
 	 * add code here too!
 	 */
-	for (c = d4_allcaches;  c != NULL;  c = c->link) {
+	for (c = d4_defaultcontext.allcaches;  c != NULL;  c = c->link) {
 		int cid = c->cacheid;
 		fprintf (f, "\n");
 
@@ -1131,7 +1500,7 @@ d4customize (FILE *f)
 	/*
 	 * Now tie all the customized values up for checking in d4setup
 	 */
-	n = d4_allcaches->cacheid;
+	n = d4_defaultcontext.allcaches->cacheid;
 	fprintf (f, "\nlong *d4_cust_vals[%d+1] = {\n\tNULL,\n", n);
 	for (i = 1;  i <= n;  i++)
 		fprintf (f, "	&d4_cust_%d_vals[0]%s\n", i, (i<n) ? "," : "");
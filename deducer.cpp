@@ -1,3 +1,4 @@
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,10 +9,25 @@
 #include <sys/stat.h>
 #include <sys/signal.h>
 
+#include <math.h>
+
+#include <string>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <list>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <sstream>
+#include <fstream>
 
 #include "trace-packet.h"
+#include "trace-reader.h"
+#include "cache-config.h"
 
 volatile bool terminate;
 
@@ -21,103 +37,1366 @@ static void sigint(int sig)
 	terminate = true;
 }
 
-static void analyse()
+/*
+ * One per-thread stream of the trace.  The packet following the current
+ * segment is kept in Head, so the merge can see where the next segment
+ * starts before committing to it.
+ */
+struct TraceStream
 {
-}
+	TraceReader Reader;
+	bool Done;
+	uint64_t Segment;
+	uint64_t Packets;
+	const TracePacket *Head;
+};
 
-int main(int argc, char **argv)
+struct KernelStatistics
 {
-	if (argc != 2) {
-		fprintf(stderr, "error: usage: %s <trace file>\n", argv[0]);
-		return 1;
+	KernelStatistics() : Invocations(0), Instructions(0), Reads(0), Writes(0) { }
+
+	uint64_t Invocations;
+	uint64_t Instructions;
+	uint64_t Reads, Writes;
+	std::vector<uint64_t> Opcodes;
+	std::unordered_map<uint64_t, uint64_t> RIPs;
+
+	void Merge(const KernelStatistics& other)
+	{
+		Invocations += other.Invocations;
+		Instructions += other.Instructions;
+		Reads += other.Reads;
+		Writes += other.Writes;
+
+		if (Opcodes.size() < other.Opcodes.size())
+			Opcodes.resize(other.Opcodes.size());
+
+		for (size_t i = 0; i < other.Opcodes.size(); i++)
+			Opcodes[i] += other.Opcodes[i];
+
+		for (const auto& rip : other.RIPs)
+			RIPs[rip.first] += rip.second;
 	}
-	
-	int fd = open(argv[1], O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "error: unable to open file: %s\n", strerror(errno));
-		return 1;
+};
+
+struct FrameStatistics
+{
+	FrameStatistics() : Start(0), End(0), Invocations(0), Instructions(0) { }
+
+	uint64_t Start, End;
+	uint64_t Invocations;
+	uint64_t Instructions;
+
+	void Merge(const FrameStatistics& other)
+	{
+		if (other.Start && (!Start || other.Start < Start)) Start = other.Start;
+		if (other.End > End) End = other.End;
+
+		Invocations += other.Invocations;
+		Instructions += other.Instructions;
 	}
-	
-	struct stat st;
-	if (fstat(fd, &st) < 0) {
-		close(fd);
-		
-		fprintf(stderr, "error: unable to stat file: %s\n", strerror(errno));
-		return 1;
+};
+
+struct KernelInvocationRecord
+{
+	uint32_t Frame;
+	uint32_t Kernel;
+	uint64_t Start, End;
+	uint64_t Instructions;
+};
+
+/* Names for kernel, opcode and category IDs, from descriptor packets */
+struct Descriptors
+{
+	std::map<uint32_t, std::string> Kernels, Opcodes, Categories;
+	std::map<uint32_t, uint32_t> OpcodeCategories;
+
+	void Merge(const Descriptors& other)
+	{
+		Kernels.insert(other.Kernels.begin(), other.Kernels.end());
+		Opcodes.insert(other.Opcodes.begin(), other.Opcodes.end());
+		Categories.insert(other.Categories.begin(), other.Categories.end());
+		OpcodeCategories.insert(other.OpcodeCategories.begin(), other.OpcodeCategories.end());
 	}
-	
-	signal(SIGINT, sigint);
-	
-	uint64_t approx_total = st.st_size / sizeof(InstructionTracePacket);
-	fprintf(stderr, "estimated number of packets: %lu\n", approx_total);
-	
-	uint64_t nr_packets = 0;
-	uint64_t reuse_tracker = 0;
-	do {
-		uint8_t type;
-		int rc = read(fd, &type, sizeof(type));
-		if (rc == 0) break;
-		
-		lseek(fd, -1, SEEK_CUR);
-		
-		switch (type) {
+};
+
+/*
+ * Everything learned from one chunk of the trace.  Results are only ever
+ * combined in chunk order, so the report is the same however many workers
+ * produced it.
+ */
+struct AnalysisResults
+{
+	AnalysisResults() : Packets(0), Instructions(0) { }
+
+	uint64_t Packets;
+	uint64_t Instructions;
+	Descriptors Names;
+	std::map<uint32_t, KernelStatistics> Kernels;
+	std::map<uint32_t, FrameStatistics> Frames;
+	std::vector<KernelInvocationRecord> Timeline;
+
+	void Merge(const AnalysisResults& other)
+	{
+		Packets += other.Packets;
+		Instructions += other.Instructions;
+		Names.Merge(other.Names);
+
+		for (const auto& kernel : other.Kernels)
+			Kernels[kernel.first].Merge(kernel.second);
+
+		for (const auto& frame : other.Frames)
+			Frames[frame.first].Merge(frame.second);
+
+		Timeline.insert(Timeline.end(), other.Timeline.begin(), other.Timeline.end());
+	}
+};
+
+/*
+ * Interprets the merged packet sequence of a chunk.  Kernel and frame state is
+ * global to the application rather than per-thread, exactly as it is in the
+ * pintool, and chunks only ever start where no kernel is in progress.
+ */
+class Analyser
+{
+public:
+	Analyser(AnalysisResults& results, uint32_t frame, bool in_frame) : Results(results), Frame(frame), CurrentFrame(NULL), Kernel(NULL), Invocation(-1), Timestamp(0)
+	{
+		if (in_frame) CurrentFrame = &Results.Frames[frame];
+	}
+
+	inline void Packet(const TracePacket *packet)
+	{
+		Results.Packets++;
+
+		switch (packet->Type) {
+		case TRACE_PACKET_SYNC:
+			Timestamp = ((const SyncTracePacket *)packet)->Timestamp;
+			break;
+
+		case TRACE_PACKET_DESCRIPTOR:
+			Describe((const DescriptorTracePacket *)packet);
+			break;
+
 		case TRACE_PACKET_FRAME_START:
+			Frame = ((const FrameTracePacket *)packet)->ID;
+			CurrentFrame = &Results.Frames[Frame];
+			CurrentFrame->Start = Timestamp;
+			break;
+
 		case TRACE_PACKET_FRAME_END:
-		{
-			FrameTracePacket ftp;
-			rc = read(fd, &ftp, sizeof(ftp));
-			if (rc != sizeof(ftp)) {
-				fprintf(stderr, "error: frame packet read error\n");
-				terminate = true;
-				continue;
-			}
-						
+			if (CurrentFrame) CurrentFrame->End = Timestamp;
+			CurrentFrame = NULL;
+			break;
+
+		case TRACE_PACKET_KERNEL_START: {
+			uint32_t id = ((const KernelTracePacket *)packet)->ID;
+
+			Kernel = &Results.Kernels[id];
+			Kernel->Invocations++;
+			if (CurrentFrame) CurrentFrame->Invocations++;
+
+			KernelInvocationRecord record;
+			record.Frame = Frame;
+			record.Kernel = id;
+			record.Start = Timestamp;
+			record.End = Timestamp;
+			record.Instructions = 0;
+
+			Invocation = Results.Timeline.size();
+			Results.Timeline.push_back(record);
+			break;
+		}
+
+		case TRACE_PACKET_KERNEL_END:
+			if (Invocation >= 0) Results.Timeline[Invocation].End = Timestamp;
+
+			Kernel = NULL;
+			Invocation = -1;
+			break;
+
+		case TRACE_PACKET_INSTRUCTION: {
+			const InstructionTracePacket *itp = (const InstructionTracePacket *)packet;
+
+			Results.Instructions++;
+			if (CurrentFrame) CurrentFrame->Instructions++;
+			if (!Kernel) break;
+
+			if (itp->Opcode >= Kernel->Opcodes.size())
+				Kernel->Opcodes.resize(itp->Opcode + 1);
+
+			Kernel->Opcodes[itp->Opcode]++;
+			Kernel->RIPs[itp->RIP]++;
+			Kernel->Instructions++;
+			Results.Timeline[Invocation].Instructions++;
+			break;
+		}
+
+		case TRACE_PACKET_MEMORY_READ:
+			if (Kernel) Kernel->Reads++;
+			break;
+
+		case TRACE_PACKET_MEMORY_WRITE:
+			if (Kernel) Kernel->Writes++;
+			break;
+		}
+	}
+
+private:
+	void Describe(const DescriptorTracePacket *dtp)
+	{
+		std::string name(dtp->Name, strnlen(dtp->Name, sizeof(dtp->Name)));
+
+		switch (dtp->Kind) {
+		case TRACE_DESCRIPTOR_KERNEL:
+			Results.Names.Kernels[dtp->ID] = name;
+			break;
+		case TRACE_DESCRIPTOR_OPCODE:
+			Results.Names.Opcodes[dtp->ID] = name;
+			Results.Names.OpcodeCategories[dtp->ID] = dtp->Category;
+			break;
+		case TRACE_DESCRIPTOR_CATEGORY:
+			Results.Names.Categories[dtp->ID] = name;
+			break;
+		}
+	}
+
+	AnalysisResults& Results;
+	uint32_t Frame;
+	FrameStatistics *CurrentFrame;
+	KernelStatistics *Kernel;
+	ssize_t Invocation;
+	uint64_t Timestamp;
+};
+
+struct CacheHierarchy
+{
+	CacheConfig Config;
+	std::vector<d4cache *> Levels;
+	std::vector<CacheSnapshot> KernelStart;
+	std::map<uint32_t, std::vector<CacheSnapshot> > Kernels;
+};
+
+/*
+ * Feeds the memory accesses made by kernels into every configured cache
+ * hierarchy, or just one of them, and accumulates each kernel's share of the
+ * hits and misses.  Accesses are handed to Dinero IV in batches, which are
+ * flushed whenever a kernel ends.
+ */
+#define CACHE_BATCH_SIZE		4096
+
+class CacheSimulator
+{
+public:
+	CacheSimulator(std::vector<CacheHierarchy>& hierarchies) : Kernel(-1), Used(0)
+	{
+		for (auto& hierarchy : hierarchies)
+			Hierarchies.push_back(&hierarchy);
+	}
+
+	CacheSimulator(CacheHierarchy& hierarchy) : Hierarchies(1, &hierarchy), Kernel(-1), Used(0) { }
+
+	std::map<uint32_t, std::string> KernelNames;
+
+	inline void Packet(const TracePacket *packet)
+	{
+		switch (packet->Type) {
+		case TRACE_PACKET_DESCRIPTOR: {
+			const DescriptorTracePacket *dtp = (const DescriptorTracePacket *)packet;
+			if (dtp->Kind == TRACE_DESCRIPTOR_KERNEL)
+				KernelNames[dtp->ID] = std::string(dtp->Name, strnlen(dtp->Name, sizeof(dtp->Name)));
 			break;
 		}
-		
+
 		case TRACE_PACKET_KERNEL_START:
+			Kernel = ((const KernelTracePacket *)packet)->ID;
+			for (auto hierarchy : Hierarchies)
+				SnapshotCacheHierarchy(hierarchy->Levels, hierarchy->KernelStart);
+			break;
+
 		case TRACE_PACKET_KERNEL_END:
-		{
-			KernelTracePacket ktp;
-			rc = read(fd, &ktp, sizeof(ktp));
-			if (rc != sizeof(ktp)) {
-				fprintf(stderr, "error: kernel packet read error\n");
-				terminate = true;
-				continue;
+			if (Kernel < 0) break;
+
+			Flush();
+
+			for (auto hierarchy : Hierarchies) {
+				std::vector<CacheSnapshot> now;
+				SnapshotCacheHierarchy(hierarchy->Levels, now);
+
+				std::vector<CacheSnapshot>& totals = hierarchy->Kernels[Kernel];
+				totals.resize(now.size());
+
+				for (size_t i = 0; i < now.size(); i++)
+					totals[i].Accumulate(hierarchy->KernelStart[i], now[i]);
 			}
-						
+
+			Kernel = -1;
+			break;
+
+		case TRACE_PACKET_MEMORY_READ:
+		case TRACE_PACKET_MEMORY_WRITE: {
+			if (Kernel < 0) break;
+
+			const MemoryTracePacket *mtp = (const MemoryTracePacket *)packet;
+
+			d4memref& memref = Batch[Used++];
+			memref.address = (d4addr)mtp->Address;
+			memref.size = mtp->Size ? mtp->Size : 1;
+			memref.accesstype = packet->Type == TRACE_PACKET_MEMORY_READ ? D4XREAD : D4XWRITE;
+
+			if (Used == CACHE_BATCH_SIZE) Flush();
 			break;
 		}
-		
-		case TRACE_PACKET_INSTRUCTION:
-		{
-			InstructionTracePacket itp;
-			rc = read(fd, &itp, sizeof(itp));
-			if (rc != sizeof(itp)) {
-				fprintf(stderr, "error: instruction packet read error\n");
+		}
+	}
+
+	void Flush()
+	{
+		if (!Used) return;
+
+		for (auto hierarchy : Hierarchies)
+			d4refbatch(hierarchy->Levels[0], Batch, Used);
+
+		Used = 0;
+	}
+
+private:
+	std::vector<CacheHierarchy *> Hierarchies;
+	int64_t Kernel;
+
+	d4memref Batch[CACHE_BATCH_SIZE];
+	unsigned int Used;
+};
+
+/*
+ * Converts memory accesses into Dinero IV's 64-bit binary input format
+ * (-informat B), so traces can be run through dineroIV directly.  Each record
+ * is a little-endian 8-byte address, 2-byte size, 1-byte access type and a
+ * byte of padding.
+ */
+#define DINERO_RECORD_SIZE		12
+#define DINERO_BUFFER_SIZE		(DINERO_RECORD_SIZE * 65536)
+
+class DineroWriter
+{
+public:
+	DineroWriter(int fd) : Records(0), FD(fd), Used(0), Failed(false) { }
+
+	uint64_t Records;
+
+	inline void Packet(const TracePacket *packet)
+	{
+		if (packet->Type != TRACE_PACKET_MEMORY_READ && packet->Type != TRACE_PACKET_MEMORY_WRITE) return;
+
+		const MemoryTracePacket *mtp = (const MemoryTracePacket *)packet;
+
+		if (Used == DINERO_BUFFER_SIZE) Flush();
+
+		uint8_t *record = Buffer + Used;
+		for (int i = 0; i < 8; i++)
+			record[i] = mtp->Address >> (i * 8);
+
+		uint16_t size = mtp->Size ? mtp->Size : 1;
+		record[8] = size;
+		record[9] = size >> 8;
+		record[10] = packet->Type == TRACE_PACKET_MEMORY_READ ? D4XREAD : D4XWRITE;
+		record[11] = 0;
+
+		Used += DINERO_RECORD_SIZE;
+		Records++;
+	}
+
+	bool Flush()
+	{
+		size_t done = 0;
+		while (done < Used && !Failed) {
+			ssize_t rc = write(FD, Buffer + done, Used - done);
+			if (rc < 0) {
+				if (errno == EINTR) continue;
+
+				fprintf(stderr, "error: unable to write dinero trace: %s\n", strerror(errno));
+				Failed = true;
 				terminate = true;
-				continue;
+			} else {
+				done += rc;
 			}
-			
-			break;
 		}
-		
-		default:
-			fprintf(stderr, "error: unknown log packet type: %d\n", type);
-				terminate = true;
-				continue;
+
+		Used = 0;
+		return !Failed;
+	}
+
+private:
+	int FD;
+	uint8_t Buffer[DINERO_BUFFER_SIZE];
+	size_t Used;
+	bool Failed;
+};
+
+/*
+ * Replays a set of streams in sequence order: repeatedly take the stream
+ * whose next segment has the smallest sequence number, and feed that segment
+ * through the analyser.
+ */
+template<typename A>
+static void Replay(std::vector<TraceStream>& streams, A& analyser, uint64_t approx_total)
+{
+	// Streams written before sync packets existed have a single segment, 0.
+	for (auto& stream : streams) {
+		stream.Head = stream.Reader.Next();
+		stream.Done = !stream.Head;
+		if (!stream.Done && stream.Head->Type == TRACE_PACKET_SYNC)
+			stream.Segment = ((const SyncTracePacket *)stream.Head)->Sequence;
+	}
+
+	uint64_t nr_packets = 0;
+	do {
+		TraceStream *next = NULL;
+		for (auto& stream : streams) {
+			if (stream.Done) continue;
+			if (!next || stream.Segment < next->Segment) next = &stream;
 		}
-		
-		nr_packets++;
-		
-		if ((nr_packets % 1000000) == 0) {
-			fprintf(stderr, "processed %lu packets (approx. %lu%%)\n", nr_packets, (nr_packets * 100) / approx_total);
+
+		if (!next) break;
+
+		// Replay the chosen stream up to the start of its next segment.
+		const TracePacket *packet = next->Head;
+		do {
+			analyser.Packet(packet);
+			next->Packets++;
+			nr_packets++;
+
+			if (approx_total && (nr_packets % 1000000) == 0) {
+				fprintf(stderr, "processed %lu packets (approx. %lu%%)\n", nr_packets, (nr_packets * 100) / approx_total);
+			}
+
+			packet = next->Reader.Next();
+			if (!packet) {
+				next->Done = true;
+				if (next->Reader.Error()) terminate = true;
+				break;
+			}
+		} while (packet->Type != TRACE_PACKET_SYNC && !terminate);
+
+		if (!next->Done) {
+			next->Head = packet;
+			next->Segment = ((const SyncTracePacket *)packet)->Sequence;
 		}
-		
 	} while(!terminate);
-	
-	analyse();
-	
-	close(fd);
+}
+
+/*
+ * One thread's stream within a live trace.  Data holds the whole segments
+ * received so far that have not been replayed yet, and Frontier is the
+ * lowest sequence number the thread could still send a new segment with.
+ */
+struct LiveStream
+{
+	LiveStream() : Consumed(0), Frontier(0), Done(false), Packets(0) { }
+
+	std::vector<uint8_t> Data;
+	size_t Consumed;
+	uint64_t Frontier;
+	bool Done;
+	uint64_t Packets;
+
+	bool Pending() const { return Consumed < Data.size(); }
+
+	uint64_t Segment() const
+	{
+		const TracePacket *packet = (const TracePacket *)&Data[Consumed];
+		if (packet->Type != TRACE_PACKET_SYNC) return 0;
+
+		return ((const SyncTracePacket *)packet)->Sequence;
+	}
+};
+
+/*
+ * Replays every segment that it is safe to replay: one that no thread can
+ * still send an earlier segment than.  Threads that have nothing pending
+ * hold the replay back until their frontier passes it.
+ */
+template<typename A>
+static bool DrainLive(std::map<uint32_t, LiveStream>& streams, A& analyser)
+{
+	while (!terminate) {
+		LiveStream *next = NULL;
+		uint64_t segment = 0, limit = UINT64_MAX;
+
+		for (auto& entry : streams) {
+			LiveStream& stream = entry.second;
+			if (stream.Pending()) {
+				uint64_t candidate = stream.Segment();
+				if (!next || candidate < segment) {
+					next = &stream;
+					segment = candidate;
+				}
+			} else if (!stream.Done && stream.Frontier < limit) {
+				limit = stream.Frontier;
+			}
+		}
+
+		if (!next || segment >= limit) break;
+
+		do {
+			const TracePacket *packet = (const TracePacket *)&next->Data[next->Consumed];
+
+			size_t size = TracePacketSize(packet->Type);
+			if (size == 0 || next->Consumed + size > next->Data.size()) {
+				fprintf(stderr, "error: live stream: malformed packet of type %d\n", packet->Type);
+				return false;
+			}
+
+			analyser.Packet(packet);
+			next->Packets++;
+			next->Consumed += size;
+		} while (next->Pending() && next->Data[next->Consumed] != TRACE_PACKET_SYNC);
+
+		if (!next->Pending()) {
+			next->Data.clear();
+			next->Consumed = 0;
+		} else if (next->Consumed > TRACE_READ_BUFFER_SIZE) {
+			next->Data.erase(next->Data.begin(), next->Data.begin() + next->Consumed);
+			next->Consumed = 0;
+		}
+	}
+
+	return true;
+}
+
+/* Demultiplexes a live trace, replaying it as soon as it is safe to */
+template<typename A>
+static bool ReplayLive(TraceReader& reader, A& analyser, std::map<uint32_t, LiveStream>& streams)
+{
+	while (!terminate) {
+		TraceChunkHeader header;
+		if (!reader.Read(&header, sizeof(header))) break;
+
+		LiveStream& stream = streams[header.ThreadID];
+
+		size_t used = stream.Data.size();
+		stream.Data.resize(used + header.Length);
+		if (!reader.Read(&stream.Data[used], header.Length)) {
+			fprintf(stderr, "error: %s: truncated chunk\n", reader.GetPath());
+			return false;
+		}
+
+		stream.Frontier = header.Watermark;
+		if (header.Flags & TRACE_CHUNK_LAST) stream.Done = true;
+
+		if (!DrainLive(streams, analyser)) return false;
+	}
+
+	if (reader.Error()) return false;
+
+	// Nothing more can arrive once the pipe is closed.
+	for (auto& stream : streams)
+		stream.second.Done = true;
+
+	return DrainLive(streams, analyser);
+}
+
+/* Runs fn(0) .. fn(count - 1) on a pool of worker threads */
+template<typename F>
+static void ParallelFor(size_t count, unsigned int workers, F fn)
+{
+	std::atomic<size_t> next_item(0);
+	std::vector<std::thread> pool;
+
+	if (workers > count) workers = count;
+	for (unsigned int i = 0; i < workers; i++) {
+		pool.push_back(std::thread([&]() {
+			size_t item;
+			while (!terminate && (item = next_item++) < count)
+				fn(item);
+		}));
+	}
+
+	for (auto& thread : pool)
+		thread.join();
+}
+
+/* A sync packet in a stream, and where it is */
+struct SyncPoint
+{
+	uint64_t Sequence;
+	uint64_t Offset;
+};
+
+/* A sync packet that is immediately followed by a frame or kernel start */
+struct Boundary
+{
+	uint64_t Sequence;
+	uint8_t Type;
+	uint32_t ID;
+
+	bool operator<(const Boundary& other) const { return Sequence < other.Sequence; }
+};
+
+struct StreamIndex
+{
+	std::vector<SyncPoint> Syncs;
+	std::vector<Boundary> Boundaries;
+};
+
+static void IndexStream(const TraceReader& source, StreamIndex& index)
+{
+	TraceReader reader;
+	reader.Slice(source, 0, source.GetSize());
+
+	const SyncTracePacket *last_sync = NULL;
+
+	uint64_t offset = reader.GetOffset();
+	const TracePacket *packet;
+	while ((packet = reader.Next()) && !terminate) {
+		if (packet->Type == TRACE_PACKET_SYNC) {
+			last_sync = (const SyncTracePacket *)packet;
+
+			SyncPoint point;
+			point.Sequence = last_sync->Sequence;
+			point.Offset = offset;
+			index.Syncs.push_back(point);
+		} else {
+			if (last_sync && (packet->Type == TRACE_PACKET_FRAME_START || packet->Type == TRACE_PACKET_KERNEL_START)) {
+				Boundary boundary;
+				boundary.Sequence = last_sync->Sequence;
+				boundary.Type = packet->Type;
+				boundary.ID = ((const FrameTracePacket *)packet)->ID;
+				index.Boundaries.push_back(boundary);
+			}
+
+			last_sync = NULL;
+		}
+
+		offset = reader.GetOffset();
+	}
+
+	if (reader.Error()) terminate = true;
+}
+
+/* Where a chunk starts in the global sequence, and the frame in progress there */
+struct Chunk
+{
+	uint64_t Sequence;
+	uint32_t Frame;
+	bool InFrame;
+};
+
+static std::vector<Chunk> PlanChunks(const std::vector<StreamIndex>& indices, bool split_kernels)
+{
+	std::vector<Boundary> boundaries;
+	for (const auto& index : indices)
+		boundaries.insert(boundaries.end(), index.Boundaries.begin(), index.Boundaries.end());
+
+	std::sort(boundaries.begin(), boundaries.end());
+
+	// The first chunk also picks up whatever precedes the first frame.
+	std::vector<Chunk> chunks;
+	Chunk chunk;
+	chunk.Sequence = 0;
+	chunk.Frame = 0;
+	chunk.InFrame = false;
+	chunks.push_back(chunk);
+
+	for (const auto& boundary : boundaries) {
+		if (boundary.Type == TRACE_PACKET_FRAME_START) {
+			chunk.Frame = boundary.ID;
+			chunk.InFrame = false;
+		} else if (!split_kernels) {
+			continue;
+		} else {
+			chunk.InFrame = true;
+		}
+
+		chunk.Sequence = boundary.Sequence;
+		if (chunk.Sequence == chunks.back().Sequence)
+			chunks.back() = chunk;
+		else
+			chunks.push_back(chunk);
+	}
+
+	return chunks;
+}
+
+static uint64_t StreamOffset(const StreamIndex& index, uint64_t sequence, uint64_t size)
+{
+	auto point = std::lower_bound(index.Syncs.begin(), index.Syncs.end(), sequence,
+		[](const SyncPoint& p, uint64_t s) { return p.Sequence < s; });
+
+	return point == index.Syncs.end() ? size : point->Offset;
+}
+
+/*
+ * Analyses mapped streams by cutting them into chunks at frame (and, with
+ * split_kernels, kernel) boundaries and analysing the chunks in parallel.
+ */
+static void AnalyseParallel(std::vector<TraceStream>& streams, unsigned int workers, bool split_kernels, AnalysisResults& results)
+{
+	std::vector<StreamIndex> indices(streams.size());
+	ParallelFor(streams.size(), workers, [&](size_t i) {
+		IndexStream(streams[i].Reader, indices[i]);
+	});
+
+	std::vector<Chunk> chunks = PlanChunks(indices, split_kernels);
+	fprintf(stderr, "analysing %lu chunks with %u workers\n", chunks.size(), workers);
+
+	std::vector<AnalysisResults> chunk_results(chunks.size());
+	std::vector<std::vector<uint64_t> > chunk_packets(chunks.size());
+	std::atomic<size_t> completed(0);
+
+	ParallelFor(chunks.size(), workers, [&](size_t c) {
+		std::vector<TraceStream> slices(streams.size());
+
+		for (size_t i = 0; i < streams.size(); i++) {
+			uint64_t size = streams[i].Reader.GetSize();
+			uint64_t begin = c == 0 ? 0 : StreamOffset(indices[i], chunks[c].Sequence, size);
+			uint64_t end = c + 1 == chunks.size() ? size : StreamOffset(indices[i], chunks[c + 1].Sequence, size);
+
+			slices[i].Reader.Slice(streams[i].Reader, begin, end);
+			slices[i].Done = false;
+			slices[i].Segment = 0;
+			slices[i].Packets = 0;
+			slices[i].Head = NULL;
+		}
+
+		Analyser analyser(chunk_results[c], chunks[c].Frame, chunks[c].InFrame);
+		Replay(slices, analyser, 0);
+
+		for (const auto& slice : slices)
+			chunk_packets[c].push_back(slice.Packets);
+
+		size_t done = ++completed;
+		if ((done % 16) == 0 || done == chunks.size()) {
+			fprintf(stderr, "analysed %lu of %lu chunks\n", done, chunks.size());
+		}
+	});
+
+	// Merging in chunk order keeps the report independent of scheduling.
+	for (size_t c = 0; c < chunks.size(); c++) {
+		results.Merge(chunk_results[c]);
+
+		for (size_t i = 0; i < chunk_packets[c].size(); i++)
+			streams[i].Packets += chunk_packets[c][i];
+	}
+}
+
+/*
+ * Replays the whole trace once for each cache hierarchy, on a pool of worker
+ * threads.  Every hierarchy has its own Dinero IV context, so the replays
+ * share nothing but the mapped trace.
+ */
+static void SimulateParallel(std::vector<TraceStream>& streams, unsigned int workers, std::vector<CacheHierarchy>& hierarchies, std::map<uint32_t, std::string>& kernel_names)
+{
+	fprintf(stderr, "simulating %lu cache hierarchies with %u workers\n", hierarchies.size(), workers);
+
+	std::vector<std::vector<uint64_t> > hierarchy_packets(hierarchies.size());
+	std::atomic<size_t> completed(0);
+
+	ParallelFor(hierarchies.size(), workers, [&](size_t h) {
+		std::vector<TraceStream> slices(streams.size());
+
+		for (size_t i = 0; i < streams.size(); i++) {
+			slices[i].Reader.Slice(streams[i].Reader, 0, streams[i].Reader.GetSize());
+			slices[i].Done = false;
+			slices[i].Segment = 0;
+			slices[i].Packets = 0;
+			slices[i].Head = NULL;
+		}
+
+		CacheSimulator simulator(hierarchies[h]);
+		Replay(slices, simulator, 0);
+
+		// Every replay sees the same descriptors.
+		if (h == 0) kernel_names = simulator.KernelNames;
+
+		for (const auto& slice : slices)
+			hierarchy_packets[h].push_back(slice.Packets);
+
+		size_t done = ++completed;
+		fprintf(stderr, "simulated %lu of %lu hierarchies (%s)\n", done, hierarchies.size(), hierarchies[h].Config.Name.c_str());
+	});
+
+	for (size_t i = 0; i < hierarchy_packets[0].size(); i++)
+		streams[i].Packets += hierarchy_packets[0][i];
+}
+
+static std::string Name(const std::map<uint32_t, std::string>& names, uint32_t id)
+{
+	auto name = names.find(id);
+	if (name != names.end()) return name->second;
+
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "%u", id);
+	return buffer;
+}
+
+static void Report(const AnalysisResults& results, unsigned int top_rips)
+{
+	const Descriptors& names = results.Names;
+
+	printf("*** KERNELS ***\n");
+	printf("kernel,invocations,instructions,reads,writes\n");
+	for (const auto& kernel : results.Kernels) {
+		printf("%s,%lu,%lu,%lu,%lu\n", Name(names.Kernels, kernel.first).c_str(), kernel.second.Invocations, kernel.second.Instructions,
+			kernel.second.Reads, kernel.second.Writes);
+	}
+
+	// Categories are a property of the opcode, so are derived rather than counted.
+	printf("*** CATEGORIES ***\n");
+	printf("kernel,category,count\n");
+	for (const auto& kernel : results.Kernels) {
+		std::map<std::string, uint64_t> categories;
+		for (size_t opcode = 0; opcode < kernel.second.Opcodes.size(); opcode++) {
+			if (kernel.second.Opcodes[opcode] == 0) continue;
+
+			auto category = names.OpcodeCategories.find(opcode);
+			if (category == names.OpcodeCategories.end())
+				categories["unknown"] += kernel.second.Opcodes[opcode];
+			else
+				categories[Name(names.Categories, category->second)] += kernel.second.Opcodes[opcode];
+		}
+
+		for (const auto& category : categories) {
+			printf("%s,%s,%lu\n", Name(names.Kernels, kernel.first).c_str(), category.first.c_str(), category.second);
+		}
+	}
+
+	printf("*** OPCODES ***\n");
+	printf("kernel,opcode,count\n");
+	for (const auto& kernel : results.Kernels) {
+		for (size_t opcode = 0; opcode < kernel.second.Opcodes.size(); opcode++) {
+			if (kernel.second.Opcodes[opcode] == 0) continue;
+			printf("%s,%s,%lu\n", Name(names.Kernels, kernel.first).c_str(), Name(names.Opcodes, opcode).c_str(), kernel.second.Opcodes[opcode]);
+		}
+	}
+
+	printf("*** HOT RIPS ***\n");
+	printf("kernel,rank,rip,count,percent\n");
+	for (const auto& kernel : results.Kernels) {
+		std::vector<std::pair<uint64_t, uint64_t> > rips(kernel.second.RIPs.begin(), kernel.second.RIPs.end());
+		size_t n = std::min<size_t>(top_rips, rips.size());
+
+		std::partial_sort(rips.begin(), rips.begin() + n, rips.end(),
+			[](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+				return a.second != b.second ? a.second > b.second : a.first < b.first;
+			});
+
+		for (size_t i = 0; i < n; i++) {
+			printf("%s,%lu,0x%lx,%lu,%.2f\n", Name(names.Kernels, kernel.first).c_str(), i + 1, rips[i].first, rips[i].second,
+				(rips[i].second * 100.0) / kernel.second.Instructions);
+		}
+	}
+
+	printf("*** FRAMES ***\n");
+	printf("frame,start,end,invocations,instructions\n");
+	for (const auto& frame : results.Frames) {
+		printf("%u,%lu,%lu,%lu,%lu\n", frame.first, frame.second.Start, frame.second.End, frame.second.Invocations, frame.second.Instructions);
+	}
+
+	printf("*** TIMELINE ***\n");
+	printf("frame,kernel,start,end,instructions\n");
+	for (const auto& record : results.Timeline) {
+		printf("%u,%s,%lu,%lu,%lu\n", record.Frame, Name(names.Kernels, record.Kernel).c_str(), record.Start, record.End, record.Instructions);
+	}
+}
+
+static void CacheReport(const std::vector<CacheHierarchy>& hierarchies, const std::map<uint32_t, std::string>& kernel_names)
+{
+	printf("*** CACHES ***\n");
+	printf("%s\n", CACHE_REPORT_HEADER);
+	for (const auto& hierarchy : hierarchies) {
+		for (const auto& kernel : hierarchy.Kernels)
+			PrintCacheReport(stdout, hierarchy.Config, Name(kernel_names, kernel.first), kernel.second);
+	}
+}
+
+static int Live(const char *path, std::vector<CacheHierarchy>& hierarchies, bool simulate_caches, unsigned int top_rips)
+{
+	TraceReader reader;
+	if (!reader.Open(path)) return 1;
+
+	std::map<uint32_t, LiveStream> streams;
+	bool ok;
+
+	if (simulate_caches) {
+		CacheSimulator simulator(hierarchies);
+		ok = ReplayLive(reader, simulator, streams);
+		CacheReport(hierarchies, simulator.KernelNames);
+	} else {
+		AnalysisResults results;
+		Analyser analyser(results, 0, false);
+		ok = ReplayLive(reader, analyser, streams);
+		Report(results, top_rips);
+	}
+
+	for (const auto& stream : streams) {
+		fprintf(stderr, "thread %u: %lu packets\n", stream.first, stream.second.Packets);
+	}
+
+	return ok && !terminate ? 0 : 1;
+}
+
+/*
+ * A section of a saved report that can be compared across captures, keyed by
+ * its leading columns: kernel names for KERNELS, and so on.  Keys are matched
+ * by name, so kernel IDs needn't agree between the two captures.
+ */
+struct ReportSection
+{
+	std::vector<std::string> Metrics;
+	std::map<std::string, std::vector<double> > Rows;
+};
+
+typedef std::map<std::string, ReportSection> ReportSections;
+
+static size_t ReportKeyColumns(const std::string& section)
+{
+	if (section == "KERNELS") return 1;
+	if (section == "CATEGORIES" || section == "OPCODES") return 2;
+	if (section == "CACHES") return 3;
 	return 0;
 }
+
+static std::vector<std::string> SplitFields(const std::string& line)
+{
+	std::vector<std::string> fields;
+	std::stringstream stream(line);
+	std::string field;
+
+	while (std::getline(stream, field, ',')) fields.push_back(field);
+	return fields;
+}
+
+static bool LoadReport(const char *path, ReportSections& sections)
+{
+	std::ifstream file(path);
+	if (!file) {
+		fprintf(stderr, "error: unable to open report: %s\n", path);
+		return false;
+	}
+
+	ReportSection *current = NULL;
+	size_t key_columns = 0, columns = 0;
+	bool header = false;
+
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.compare(0, 4, "*** ") == 0) {
+			std::string name = line.substr(4, line.rfind(" ***") - 4);
+
+			key_columns = ReportKeyColumns(name);
+			current = key_columns ? &sections[name] : NULL;
+			header = true;
+			continue;
+		}
+
+		if (!current) continue;
+
+		std::vector<std::string> fields = SplitFields(line);
+		if (header) {
+			current->Metrics.assign(fields.begin() + std::min(key_columns, fields.size()), fields.end());
+			columns = fields.size();
+			header = false;
+			continue;
+		}
+
+		// Kernel names can contain commas, so metrics are counted from the right.
+		if (fields.size() < columns) {
+			fprintf(stderr, "error: %s: malformed report line: %s\n", path, line.c_str());
+			return false;
+		}
+
+		size_t split = fields.size() - current->Metrics.size();
+		std::string key = fields[0];
+		for (size_t i = 1; i < split; i++) key += "," + fields[i];
+
+		std::vector<double>& values = current->Rows[key];
+		values.resize(current->Metrics.size());
+		for (size_t i = 0; i < values.size(); i++)
+			values[i] += strtod(fields[split + i].c_str(), NULL);
+	}
+
+	return true;
+}
+
+/*
+ * Compares two saved reports, printing every metric that changed by at least
+ * threshold percent and by at least min_delta.  Rows present in only one
+ * report count as a change from zero.  Returns the number of significant
+ * changes.
+ */
+static unsigned int DiffReports(const ReportSections& before, const ReportSections& after, double threshold, double min_delta)
+{
+	static const char *order[] = { "KERNELS", "CATEGORIES", "OPCODES", "CACHES" };
+	static const std::vector<double> none;
+	unsigned int changes = 0;
+
+	printf("*** DIFF ***\n");
+	printf("section,key,metric,before,after,delta,percent\n");
+
+	for (const char *name : order) {
+		auto b = before.find(name), a = after.find(name);
+		if (b == before.end() && a == after.end()) continue;
+
+		const ReportSection& metrics = b != before.end() ? b->second : a->second;
+
+		std::set<std::string> keys;
+		if (b != before.end()) for (const auto& row : b->second.Rows) keys.insert(row.first);
+		if (a != after.end()) for (const auto& row : a->second.Rows) keys.insert(row.first);
+
+		for (const auto& key : keys) {
+			const std::vector<double> *bv = &none, *av = &none;
+			if (b != before.end() && b->second.Rows.count(key)) bv = &b->second.Rows.at(key);
+			if (a != after.end() && a->second.Rows.count(key)) av = &a->second.Rows.at(key);
+
+			for (size_t i = 0; i < metrics.Metrics.size(); i++) {
+				double from = i < bv->size() ? (*bv)[i] : 0, to = i < av->size() ? (*av)[i] : 0;
+				double delta = to - from;
+
+				if (delta == 0 || fabs(delta) < min_delta || fabs(delta) * 100 < threshold * fabs(from)) continue;
+
+				if (from == 0)
+					printf("%s,%s,%s,%.0f,%.0f,%+.0f,new\n", name, key.c_str(), metrics.Metrics[i].c_str(), from, to, delta);
+				else
+					printf("%s,%s,%s,%.0f,%.0f,%+.0f,%+.2f\n", name, key.c_str(), metrics.Metrics[i].c_str(), from, to, delta, (delta * 100) / from);
+				changes++;
+			}
+		}
+	}
+
+	return changes;
+}
+
+static bool OpenStreams(char **paths, size_t count, bool map, std::vector<TraceStream>& streams)
+{
+	streams.clear();
+	streams.resize(count);
+
+	for (size_t i = 0; i < count; i++) {
+		TraceStream& stream = streams[i];
+		stream.Done = false;
+		stream.Segment = 0;
+		stream.Packets = 0;
+		stream.Head = NULL;
+
+		if (!stream.Reader.Open(paths[i], map)) return false;
+	}
+
+	return true;
+}
+
+/* Replays the trace without looking at it, to measure the cost of the merge alone */
+struct NullAnalyser
+{
+	inline void Packet(const TracePacket *) { }
+};
+
+struct BenchmarkResult
+{
+	std::string Path;
+	uint64_t Packets;
+	double Seconds;
+};
+
+/*
+ * Runs the trace through every reader and analysis in turn, timing each one.
+ * Each run reopens the trace, but the page cache will usually be warm after
+ * the first, so the first run is a plain read to warm it.
+ */
+static int Benchmark(char **paths, size_t count, unsigned int workers, bool split_kernels, std::vector<CacheHierarchy>& hierarchies)
+{
+	std::vector<BenchmarkResult> results;
+	uint64_t bytes = 0;
+	volatile uint8_t sink = 0;
+
+	auto run = [&](const char *path, bool map, std::function<uint64_t(std::vector<TraceStream>&)> fn) -> bool {
+		std::vector<TraceStream> streams;
+		if (!OpenStreams(paths, count, map, streams)) return false;
+
+		fprintf(stderr, "benchmarking %s\n", path);
+
+		auto start = std::chrono::steady_clock::now();
+		uint64_t packets = fn(streams);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		for (const auto& stream : streams)
+			if (stream.Reader.Error()) terminate = true;
+
+		BenchmarkResult result;
+		result.Path = path;
+		result.Packets = packets;
+		result.Seconds = elapsed.count();
+		results.push_back(result);
+
+		return !terminate;
+	};
+
+	auto read = [&](std::vector<TraceStream>& streams) {
+		uint64_t packets = 0;
+		for (auto& stream : streams) {
+			const TracePacket *packet;
+			while ((packet = stream.Reader.Next()) != NULL && !terminate) {
+				sink += packet->Type;
+				packets++;
+			}
+		}
+		return packets;
+	};
+
+	auto packets = [](const std::vector<TraceStream>& streams) {
+		uint64_t total = 0;
+		for (const auto& stream : streams) total += stream.Packets;
+		return total;
+	};
+
+	std::vector<TraceStream> streams;
+	if (!OpenStreams(paths, count, true, streams)) return 1;
+	for (const auto& stream : streams) {
+		if (!stream.Reader.Mapped()) {
+			fprintf(stderr, "error: %s: benchmarks need a trace file that can be mapped\n", stream.Reader.GetPath());
+			return 1;
+		}
+
+		bytes += stream.Reader.GetSize();
+	}
+	streams.clear();
+
+	bool ok = run("warmup", true, read);
+	results.clear();
+
+	ok = ok && run("read-mapped", true, read);
+	ok = ok && run("read-buffered", false, read);
+
+	ok = ok && run("replay", true, [&](std::vector<TraceStream>& streams) {
+		NullAnalyser analyser;
+		Replay(streams, analyser, 0);
+		return packets(streams);
+	});
+
+	ok = ok && run("analyse", true, [&](std::vector<TraceStream>& streams) {
+		AnalysisResults results;
+		Analyser analyser(results, 0, false);
+		Replay(streams, analyser, 0);
+		return packets(streams);
+	});
+
+	ok = ok && run("analyse-parallel", true, [&](std::vector<TraceStream>& streams) {
+		AnalysisResults results;
+		AnalyseParallel(streams, workers, split_kernels, results);
+		return packets(streams);
+	});
+
+	ok = ok && run("dinero", true, [&](std::vector<TraceStream>& streams) {
+		int fd = open("/dev/null", O_WRONLY);
+		DineroWriter *writer = new DineroWriter(fd);
+		Replay(streams, *writer, 0);
+		writer->Flush();
+		delete writer;
+		close(fd);
+		return packets(streams);
+	});
+
+	if (!hierarchies.empty()) {
+		ok = ok && run("caches", true, [&](std::vector<TraceStream>& streams) {
+			CacheSimulator simulator(hierarchies);
+			Replay(streams, simulator, 0);
+			simulator.Flush();
+			return packets(streams);
+		});
+	}
+
+	printf("*** BENCHMARK ***\n");
+	printf("path,packets,bytes,seconds,packets_per_second,mb_per_second\n");
+	for (const auto& result : results) {
+		printf("%s,%lu,%lu,%.3f,%.0f,%.1f\n", result.Path.c_str(), result.Packets, bytes, result.Seconds,
+			result.Packets / result.Seconds, bytes / result.Seconds / (1 << 20));
+	}
+
+	return ok ? 0 : 1;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "error: usage: %s [-j <workers>] [-k] [-n <rips>] [-c <cache config>] <trace file> [<trace file> ...]\n", program);
+	fprintf(stderr, "       %s -l [-n <rips>] [-c <cache config>] <live trace>\n", program);
+	fprintf(stderr, "       %s -b <output> <trace file> [<trace file> ...]\n", program);
+	fprintf(stderr, "       %s -d [-t <percent>] [-m <count>] <before report> <after report>\n", program);
+	fprintf(stderr, "       %s -x [-j <workers>] [-k] [-c <cache config>] <trace file> [<trace file> ...]\n", program);
+	fprintf(stderr, "  -j <workers>  number of analysis threads (default: one per core)\n");
+	fprintf(stderr, "  -k            split the trace at kernel, as well as frame, boundaries\n");
+	fprintf(stderr, "  -n <rips>     number of hot instructions to report per kernel (default: 10)\n");
+	fprintf(stderr, "  -c <file>     replay memory accesses through the cache hierarchies in <file>\n");
+	fprintf(stderr, "  -l            read a live trace written by SBPT -trace_stream, e.g. from a named pipe\n");
+	fprintf(stderr, "  -b <output>   convert memory accesses to Dinero IV's -informat B, or to stdout with -\n");
+	fprintf(stderr, "  -d            compare two saved reports, exiting with status 2 if anything changed significantly\n");
+	fprintf(stderr, "  -t <percent>  smallest relative change -d treats as significant (default: 2)\n");
+	fprintf(stderr, "  -m <count>    smallest absolute change -d treats as significant (default: 1000)\n");
+	fprintf(stderr, "  -x            measure the throughput of every reader and analysis\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int workers = std::thread::hardware_concurrency();
+	unsigned int top_rips = 10;
+	bool split_kernels = false;
+	const char *cache_config = NULL;
+	bool live = false;
+	const char *dinero_output = NULL;
+	bool diff = false;
+	bool benchmark = false;
+	double threshold = 2, min_delta = 1000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "j:kn:c:lb:dt:m:x")) != -1) {
+		switch (opt) {
+		case 'j':
+			workers = atoi(optarg);
+			break;
+		case 'k':
+			split_kernels = true;
+			break;
+		case 'n':
+			top_rips = atoi(optarg);
+			break;
+		case 'c':
+			cache_config = optarg;
+			break;
+		case 'l':
+			live = true;
+			break;
+		case 'b':
+			dinero_output = optarg;
+			break;
+		case 'd':
+			diff = true;
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'm':
+			min_delta = atof(optarg);
+			break;
+		case 'x':
+			benchmark = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc || (live && optind + 1 != argc) || (dinero_output && (live || cache_config)) || (benchmark && (live || dinero_output))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (diff) {
+		if (optind + 2 != argc) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		ReportSections before, after;
+		if (!LoadReport(argv[optind], before) || !LoadReport(argv[optind + 1], after)) return 1;
+
+		unsigned int changes = DiffReports(before, after, threshold, min_delta);
+		fprintf(stderr, "%u significant changes\n", changes);
+		return changes ? 2 : 0;
+	}
+
+	if (workers == 0) workers = 1;
+
+	std::vector<CacheHierarchy> hierarchies;
+	if (cache_config) {
+		std::vector<CacheConfig> configs;
+		std::string error;
+		if (!LoadCacheConfigs(cache_config, configs, error)) {
+			fprintf(stderr, "error: %s\n", error.c_str());
+			return 1;
+		}
+
+		hierarchies.resize(configs.size());
+		for (size_t i = 0; i < configs.size(); i++) {
+			hierarchies[i].Config = configs[i];
+
+			int err = BuildCacheHierarchy(configs[i], hierarchies[i].Levels);
+			if (err) {
+				fprintf(stderr, "error: unable to set up caches: %s: %d\n", configs[i].Name.c_str(), err);
+				return 1;
+			}
+		}
+	}
+
+	if (live) {
+		signal(SIGINT, sigint);
+		return Live(argv[optind], hierarchies, cache_config != NULL, top_rips);
+	}
+
+	if (benchmark) {
+		signal(SIGINT, sigint);
+		return Benchmark(argv + optind, argc - optind, workers, split_kernels, hierarchies);
+	}
+
+	std::vector<TraceStream> streams;
+	if (!OpenStreams(argv + optind, argc - optind, true, streams)) return 1;
+
+	uint64_t approx_total = 0;
+	bool mapped = true;
+
+	for (const auto& stream : streams) {
+		approx_total += stream.Reader.GetSize() / sizeof(InstructionTracePacket);
+		if (!stream.Reader.Mapped()) mapped = false;
+	}
+
+	signal(SIGINT, sigint);
+
+	if (approx_total == 0) approx_total = 1;
+	fprintf(stderr, "estimated number of packets: %lu\n", approx_total);
+
+	AnalysisResults results;
+
+	if (dinero_output) {
+		int fd = strcmp(dinero_output, "-") ? open(dinero_output, O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO;
+		if (fd < 0) {
+			fprintf(stderr, "error: unable to open file: %s: %s\n", dinero_output, strerror(errno));
+			return 1;
+		}
+
+		// Converting keeps the accesses in trace order, just like a cache replay.
+		DineroWriter *writer = new DineroWriter(fd);
+		Replay(streams, *writer, approx_total);
+		writer->Flush();
+
+		fprintf(stderr, "wrote %lu dinero records\n", writer->Records);
+		delete writer;
+
+		if (fd != STDOUT_FILENO) close(fd);
+	} else if (cache_config && (!mapped || workers == 1 || hierarchies.size() == 1)) {
+		// Cache state carries from one access to the next, so the whole
+		// trace is replayed in order through every hierarchy at once.
+		CacheSimulator simulator(hierarchies);
+		Replay(streams, simulator, approx_total);
+
+		CacheReport(hierarchies, simulator.KernelNames);
+	} else if (cache_config) {
+		// Hierarchies are independent, so each can have a replay of its own.
+		std::map<uint32_t, std::string> kernel_names;
+		SimulateParallel(streams, workers, hierarchies, kernel_names);
+
+		CacheReport(hierarchies, kernel_names);
+	} else if (!mapped || workers == 1) {
+		// Pipes can only be read once, front to back.
+		Analyser analyser(results, 0, false);
+		Replay(streams, analyser, approx_total);
+	} else {
+		AnalyseParallel(streams, workers, split_kernels, results);
+	}
+
+	if (!cache_config && !dinero_output) Report(results, top_rips);
+
+	for (auto& stream : streams) {
+		fprintf(stderr, "%s: %lu packets\n", stream.Reader.GetPath(), stream.Packets);
+	}
+
+	return terminate ? 1 : 0;
+}
@@ -0,0 +1,456 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include <string>
+#include <vector>
+
+#include "trace-packet.h"
+
+/*
+ * Writes synthetic traces in the same format, and with the same structure, as
+ * SBPT -trace_kinst 1 -trace_kmem 1: one stream per thread, frames of kernels
+ * run by every thread, and sync packets wherever SBPT would write them.  They
+ * are meant for measuring and regression testing the offline tools, not for
+ * drawing conclusions about any real application.
+ */
+
+#define GEN_BUFFER_SIZE		(1 << 20)
+
+/* Base of the synthetic code: each kernel is a loop of GEN_LOOP_SIZE instructions */
+#define GEN_CODE_BASE		0x400000
+#define GEN_KERNEL_CODE_SIZE	0x10000
+#define GEN_LOOP_SIZE		64
+
+/* Base of the data each thread's memory stream walks */
+#define GEN_DATA_BASE		0x7f0000000000ull
+
+#define PATTERN_STRIDE		0
+#define PATTERN_RANDOM		1
+#define PATTERN_STENCIL		2
+#define PATTERN_MIX		3
+
+struct GenOpcode
+{
+	const char *Name;
+	uint32_t Category;
+};
+
+static const char *categories[] = { "BINARY", "DATAXFER", "SSE", "COND_BR", "LOGICAL" };
+
+static const GenOpcode opcodes[] = {
+	{ "ADD", 0 }, { "SUB", 0 }, { "IMUL", 0 }, { "CMP", 0 },
+	{ "MOV", 1 }, { "MOVSXD", 1 }, { "LEA", 1 },
+	{ "ADDSS", 2 }, { "MULSS", 2 }, { "MOVSS", 2 }, { "SQRTSS", 2 },
+	{ "JNZ", 3 }, { "JL", 3 },
+	{ "AND", 4 }, { "XOR", 4 }, { "SHL", 4 },
+};
+
+#define NR_OPCODES (sizeof(opcodes) / sizeof(opcodes[0]))
+
+struct GenOptions
+{
+	GenOptions() : Prefix("trace"), Threads(4), Frames(10), Kernels(8), Instructions(100000), Pattern(PATTERN_MIX),
+		MemoryPercent(40), WritePercent(30), Stride(64), WorkingSet(64 << 20), Seed(1) { }
+
+	const char *Prefix;
+	unsigned int Threads, Frames, Kernels;
+	uint64_t Instructions;
+	int Pattern;
+	unsigned int MemoryPercent, WritePercent;
+	uint64_t Stride, WorkingSet;
+	uint64_t Seed;
+};
+
+static uint64_t NextSequence;
+static uint64_t Timestamp;
+
+class GenStream
+{
+public:
+	GenStream() : SinceSync(0), Bytes(0), FD(-1), Used(0) { }
+
+	bool Open(const std::string& path)
+	{
+		Path = path;
+		FD = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (FD < 0) {
+			fprintf(stderr, "error: unable to open file: %s: %s\n", path.c_str(), strerror(errno));
+			return false;
+		}
+
+		return true;
+	}
+
+	bool Close()
+	{
+		bool ok = Flush();
+		if (close(FD) < 0) ok = false;
+		FD = -1;
+		return ok;
+	}
+
+	inline void Emit(const void *packet, size_t size)
+	{
+		if (Used + size > GEN_BUFFER_SIZE) Flush();
+
+		memcpy(Buffer + Used, packet, size);
+		Used += size;
+		Bytes += size;
+	}
+
+	void Sync()
+	{
+		SyncTracePacket stp;
+		stp.Type = TRACE_PACKET_SYNC;
+		stp.Sequence = NextSequence++;
+		stp.Timestamp = Timestamp;
+		Emit(&stp, sizeof(stp));
+
+		SinceSync = 0;
+	}
+
+	void Event(uint8_t type, uint32_t id)
+	{
+		KernelTracePacket ktp;
+		ktp.Type = type;
+		ktp.ID = id;
+
+		Sync();
+		Emit(&ktp, sizeof(ktp));
+	}
+
+	void Describe(uint8_t kind, uint32_t id, uint32_t category, const std::string& name)
+	{
+		DescriptorTracePacket dtp;
+		memset(&dtp, 0, sizeof(dtp));
+		dtp.Type = TRACE_PACKET_DESCRIPTOR;
+		dtp.Kind = kind;
+		dtp.ID = id;
+		dtp.Category = category;
+		strncpy(dtp.Name, name.c_str(), sizeof(dtp.Name) - 1);
+
+		Sync();
+		Emit(&dtp, sizeof(dtp));
+	}
+
+	void Thread(uint8_t type, uint32_t tid)
+	{
+		ThreadTracePacket ttp;
+		ttp.Type = type;
+		ttp.ThreadID = tid;
+		ttp.OSThreadID = 1000 + tid;
+		ttp.ParentOSThreadID = tid ? 1000 : 0;
+
+		Sync();
+		Emit(&ttp, sizeof(ttp));
+	}
+
+	uint64_t SinceSync;
+	uint64_t Bytes;
+
+private:
+	bool Flush()
+	{
+		size_t done = 0;
+		while (done < Used) {
+			ssize_t rc = write(FD, Buffer + done, Used - done);
+			if (rc < 0) {
+				if (errno == EINTR) continue;
+
+				fprintf(stderr, "error: unable to write file: %s: %s\n", Path.c_str(), strerror(errno));
+				exit(1);
+			}
+
+			done += rc;
+		}
+
+		Used = 0;
+		return true;
+	}
+
+	std::string Path;
+	int FD;
+	uint8_t Buffer[GEN_BUFFER_SIZE];
+	size_t Used;
+};
+
+/*
+ * The addresses one thread touches while running one kernel.  Strided streams
+ * walk the working set a fixed distance at a time, random streams pick any
+ * element of it, and stencil streams sweep a 2D grid of floats, reading each
+ * point's four neighbours and writing the point to a second grid.
+ */
+class MemoryStream
+{
+public:
+	MemoryStream(int pattern, uint64_t base, const GenOptions& options, uint64_t seed) : Pattern(pattern), Base(base),
+		Size(options.WorkingSet), Stride(options.Stride), State(seed | 1), Position(0), Step(0)
+	{
+		Width = (uint64_t)sqrt((double)(Size / 2 / sizeof(float)));
+		if (Width < 3) Width = 3;
+	}
+
+	inline uint64_t Next(bool& write)
+	{
+		switch (Pattern) {
+		case PATTERN_STRIDE:
+			Position = (Position + Stride) % Size;
+			return Base + Position;
+
+		case PATTERN_RANDOM:
+			return Base + (Random() % Size & ~(uint64_t)(sizeof(float) - 1));
+
+		default: {
+			// Neighbours north, west, east and south of the point, then the point itself.
+			static const int64_t dx[] = { 0, -1, 1, 0 }, dy[] = { -1, 0, 0, 1 };
+
+			uint64_t x = 1 + Position % (Width - 2), y = 1 + (Position / (Width - 2)) % (Width - 2);
+			uint64_t address;
+
+			if (Step < 4) {
+				address = Base + ((y + dy[Step]) * Width + x + dx[Step]) * sizeof(float);
+			} else {
+				address = Base + (Width * Width + y * Width + x) * sizeof(float);
+				write = true;
+			}
+
+			if (++Step == 5) {
+				Step = 0;
+				Position++;
+			}
+
+			return address;
+		}
+		}
+	}
+
+	inline uint64_t Random()
+	{
+		State ^= State << 13;
+		State ^= State >> 7;
+		State ^= State << 17;
+		return State;
+	}
+
+private:
+	int Pattern;
+	uint64_t Base, Size, Stride;
+	uint64_t State;
+	uint64_t Position, Width;
+	unsigned int Step;
+};
+
+static void RunKernel(std::vector<GenStream *>& streams, const GenOptions& options, uint32_t kernel, uint64_t frame)
+{
+	int pattern = options.Pattern == PATTERN_MIX ? (int)(kernel % 3) : options.Pattern;
+
+	std::vector<MemoryStream> memory;
+	std::vector<uint64_t> done(streams.size(), 0);
+
+	for (size_t t = 0; t < streams.size(); t++) {
+		uint64_t base = GEN_DATA_BASE + ((uint64_t)kernel << 36) + ((uint64_t)t << 32);
+		memory.push_back(MemoryStream(pattern, base, options, options.Seed * 0x9e3779b97f4a7c15ull + (frame << 20) + (kernel << 8) + t));
+	}
+
+	// Threads take turns, one sync interval at a time, as they would when
+	// running side by side.
+	bool busy = true;
+	while (busy) {
+		busy = false;
+
+		for (size_t t = 0; t < streams.size(); t++) {
+			GenStream *stream = streams[t];
+			MemoryStream& mem = memory[t];
+
+			if (done[t] == options.Instructions) continue;
+			busy = true;
+
+			stream->Sync();
+			while (done[t] < options.Instructions && stream->SinceSync < TRACE_SYNC_INTERVAL) {
+				uint64_t rip = GEN_CODE_BASE + kernel * GEN_KERNEL_CODE_SIZE + (done[t] % GEN_LOOP_SIZE) * 4;
+
+				InstructionTracePacket itp;
+				itp.Type = TRACE_PACKET_INSTRUCTION;
+				itp.RIP = rip;
+				itp.Opcode = (uint32_t)((rip >> 2) * 7 % NR_OPCODES);
+				stream->Emit(&itp, sizeof(itp));
+				stream->SinceSync++;
+
+				if (mem.Random() % 100 < options.MemoryPercent) {
+					bool write = pattern != PATTERN_STENCIL && mem.Random() % 100 < options.WritePercent;
+
+					MemoryTracePacket mtp;
+					mtp.RIP = rip;
+					mtp.Address = mem.Next(write);
+					mtp.Size = sizeof(float);
+					mtp.Type = write ? TRACE_PACKET_MEMORY_WRITE : TRACE_PACKET_MEMORY_READ;
+					stream->Emit(&mtp, sizeof(mtp));
+					stream->SinceSync++;
+				}
+
+				done[t]++;
+			}
+
+			Timestamp += 1000;
+		}
+	}
+}
+
+static int PatternFromName(const char *name)
+{
+	if (!strcmp(name, "stride")) return PATTERN_STRIDE;
+	if (!strcmp(name, "random")) return PATTERN_RANDOM;
+	if (!strcmp(name, "stencil")) return PATTERN_STENCIL;
+	if (!strcmp(name, "mix")) return PATTERN_MIX;
+	return -1;
+}
+
+static bool ParseSize(const char *value, uint64_t& size)
+{
+	char *end;
+	size = strtoull(value, &end, 0);
+
+	switch (*end) {
+	case 'k': case 'K': size <<= 10; end++; break;
+	case 'm': case 'M': size <<= 20; end++; break;
+	case 'g': case 'G': size <<= 30; end++; break;
+	}
+
+	return end != value && *end == '\0' && size > 0;
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "error: usage: %s [-o <prefix>] [-t <threads>] [-f <frames>] [-k <kernels>] [-i <instructions>]\n", program);
+	fprintf(stderr, "       [-p stride|random|stencil|mix] [-r <percent>] [-w <percent>] [-s <stride>] [-S <working set>] [-e <seed>]\n");
+	fprintf(stderr, "  -o <prefix>   write <prefix>.<thread>.bin (default: trace)\n");
+	fprintf(stderr, "  -t <threads>  number of application threads (default: 4)\n");
+	fprintf(stderr, "  -f <frames>   number of frames (default: 10)\n");
+	fprintf(stderr, "  -k <kernels>  number of kernels run in every frame (default: 8)\n");
+	fprintf(stderr, "  -i <count>    instructions each thread executes per kernel invocation (default: 100000)\n");
+	fprintf(stderr, "  -p <pattern>  memory access pattern, mix uses a different one for each kernel (default: mix)\n");
+	fprintf(stderr, "  -r <percent>  percentage of instructions that access memory (default: 40)\n");
+	fprintf(stderr, "  -w <percent>  percentage of strided and random accesses that are writes (default: 30)\n");
+	fprintf(stderr, "  -s <bytes>    stride of strided accesses (default: 64)\n");
+	fprintf(stderr, "  -S <bytes>    working set of each thread, per kernel (default: 64m)\n");
+	fprintf(stderr, "  -e <seed>     random seed (default: 1)\n");
+}
+
+int main(int argc, char **argv)
+{
+	GenOptions options;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "o:t:f:k:i:p:r:w:s:S:e:")) != -1) {
+		switch (opt) {
+		case 'o':
+			options.Prefix = optarg;
+			break;
+		case 't':
+			options.Threads = atoi(optarg);
+			break;
+		case 'f':
+			options.Frames = atoi(optarg);
+			break;
+		case 'k':
+			options.Kernels = atoi(optarg);
+			break;
+		case 'i':
+			if (!ParseSize(optarg, options.Instructions)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			options.Pattern = PatternFromName(optarg);
+			break;
+		case 'r':
+			options.MemoryPercent = atoi(optarg);
+			break;
+		case 'w':
+			options.WritePercent = atoi(optarg);
+			break;
+		case 's':
+			if (!ParseSize(optarg, options.Stride)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'S':
+			if (!ParseSize(optarg, options.WorkingSet)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'e':
+			options.Seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind != argc || options.Threads == 0 || options.Pattern < 0 || options.MemoryPercent > 100 || options.WritePercent > 100) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	std::vector<GenStream *> streams;
+	for (unsigned int t = 0; t < options.Threads; t++) {
+		char path[4096];
+		snprintf(path, sizeof(path), "%s.%u.bin", options.Prefix, t);
+
+		GenStream *stream = new GenStream();
+		if (!stream->Open(path)) return 1;
+
+		stream->Thread(TRACE_PACKET_THREAD_START, t);
+		streams.push_back(stream);
+	}
+
+	// Everything the main thread describes, it describes before first use.
+	GenStream *main_stream = streams[0];
+	for (uint32_t c = 0; c < sizeof(categories) / sizeof(categories[0]); c++)
+		main_stream->Describe(TRACE_DESCRIPTOR_CATEGORY, c, 0, categories[c]);
+
+	for (uint32_t o = 0; o < NR_OPCODES; o++)
+		main_stream->Describe(TRACE_DESCRIPTOR_OPCODE, o, opcodes[o].Category, opcodes[o].Name);
+
+	for (uint32_t f = 0; f < options.Frames; f++) {
+		main_stream->Event(TRACE_PACKET_FRAME_START, f);
+
+		for (uint32_t k = 0; k < options.Kernels; k++) {
+			if (f == 0) {
+				char name[32];
+				snprintf(name, sizeof(name), "kernel_%u", k);
+				main_stream->Describe(TRACE_DESCRIPTOR_KERNEL, k, 0, name);
+			}
+
+			main_stream->Event(TRACE_PACKET_KERNEL_START, k);
+			RunKernel(streams, options, k, f);
+			main_stream->Event(TRACE_PACKET_KERNEL_END, k);
+		}
+
+		main_stream->Event(TRACE_PACKET_FRAME_END, f);
+	}
+
+	uint64_t bytes = 0;
+	bool ok = true;
+	for (unsigned int t = options.Threads; t-- > 0;) {
+		GenStream *stream = streams[t];
+		stream->Thread(TRACE_PACKET_THREAD_END, t);
+
+		bytes += stream->Bytes;
+		if (!stream->Close()) ok = false;
+		delete stream;
+	}
+
+	fprintf(stderr, "wrote %lu bytes in %u streams\n", bytes, options.Threads);
+	return ok ? 0 : 1;
+}
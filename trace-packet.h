@@ -24,11 +24,122 @@ struct FrameTracePacket : public TracePacket
 	uint32_t ID;
 } __trace_packed;
 
+struct MemoryTracePacket : public TracePacket
+{
+	uint64_t RIP;
+	uint64_t Address;
+	uint16_t Size;
+} __trace_packed;
+
+/*
+ * Every application thread writes its own stream.  Streams are stitched back
+ * together offline using sync packets: each one carries a globally unique,
+ * monotonically increasing sequence number, and starts a new segment of the
+ * stream.  Ordering the segments of all streams by their sequence numbers
+ * gives a consistent interleaving.
+ */
+struct SyncTracePacket : public TracePacket
+{
+	uint64_t Sequence;
+	uint64_t Timestamp;
+} __trace_packed;
+
+struct ThreadTracePacket : public TracePacket
+{
+	uint32_t ThreadID;
+	uint32_t OSThreadID;
+	uint32_t ParentOSThreadID;
+} __trace_packed;
+
+struct JoinTracePacket : public TracePacket
+{
+	uint64_t Handle;
+} __trace_packed;
+
+/*
+ * Names for the IDs used by other packets.  A descriptor is written before
+ * the first packet that uses its ID, on whichever stream needs it first.
+ */
+#define TRACE_DESCRIPTOR_NAME_SIZE	112
+
+struct DescriptorTracePacket : public TracePacket
+{
+	uint8_t Kind;
+	uint32_t ID;
+	uint32_t Category;
+	char Name[TRACE_DESCRIPTOR_NAME_SIZE];
+} __trace_packed;
+
+#define TRACE_DESCRIPTOR_KERNEL		0
+#define TRACE_DESCRIPTOR_OPCODE		1	/* Category is the opcode's instruction category */
+#define TRACE_DESCRIPTOR_CATEGORY	2
+
 #define TRACE_PACKET_KERNEL_START	0
 #define TRACE_PACKET_KERNEL_END		1
 #define TRACE_PACKET_FRAME_START	2
 #define TRACE_PACKET_FRAME_END		3
 #define TRACE_PACKET_INSTRUCTION	4
+#define TRACE_PACKET_SYNC		5
+#define TRACE_PACKET_THREAD_START	6
+#define TRACE_PACKET_THREAD_END		7
+#define TRACE_PACKET_THREAD_JOIN	8
+#define TRACE_PACKET_BARRIER_ENTER	9
+#define TRACE_PACKET_BARRIER_EXIT	10
+#define TRACE_PACKET_DESCRIPTOR		11
+#define TRACE_PACKET_MEMORY_READ	12
+#define TRACE_PACKET_MEMORY_WRITE	13
 
-#endif /* TRACE_PACKET_H */
+/*
+ * A live trace multiplexes every thread's stream into a single pipe.  Each
+ * flush of a thread's buffer becomes one chunk, holding whole segments only.
+ * Watermark is the next sequence number that was due to be handed out when
+ * the chunk was written, so no later segment from that thread is below it.
+ */
+struct TraceChunkHeader
+{
+	uint32_t ThreadID;
+	uint32_t Length;
+	uint32_t Flags;
+	uint64_t Watermark;
+} __trace_packed;
+
+#define TRACE_CHUNK_LAST		1	/* The thread has exited */
+
+/* Sync packets are also emitted after this many instructions on a thread */
+#define TRACE_SYNC_INTERVAL		65536
+
+/* No packet is ever larger than this */
+#define TRACE_PACKET_MAX_SIZE		256
 
+static inline size_t TracePacketSize(uint8_t type)
+{
+	switch (type) {
+	case TRACE_PACKET_KERNEL_START:
+	case TRACE_PACKET_KERNEL_END:
+		return sizeof(KernelTracePacket);
+	case TRACE_PACKET_FRAME_START:
+	case TRACE_PACKET_FRAME_END:
+		return sizeof(FrameTracePacket);
+	case TRACE_PACKET_INSTRUCTION:
+		return sizeof(InstructionTracePacket);
+	case TRACE_PACKET_SYNC:
+		return sizeof(SyncTracePacket);
+	case TRACE_PACKET_THREAD_START:
+	case TRACE_PACKET_THREAD_END:
+		return sizeof(ThreadTracePacket);
+	case TRACE_PACKET_THREAD_JOIN:
+		return sizeof(JoinTracePacket);
+	case TRACE_PACKET_BARRIER_ENTER:
+	case TRACE_PACKET_BARRIER_EXIT:
+		return sizeof(TracePacket);
+	case TRACE_PACKET_DESCRIPTOR:
+		return sizeof(DescriptorTracePacket);
+	case TRACE_PACKET_MEMORY_READ:
+	case TRACE_PACKET_MEMORY_WRITE:
+		return sizeof(MemoryTracePacket);
+	default:
+		return 0;
+	}
+}
+
+#endif /* TRACE_PACKET_H */
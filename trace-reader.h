@@ -0,0 +1,210 @@
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace-packet.h"
+
+/* Read size used when the trace cannot be mapped, e.g. when it is a pipe */
+#define TRACE_READ_BUFFER_SIZE		(4 << 20)
+
+/*
+ * Reads packets out of a trace without copying them.  Regular files are
+ * mapped in their entirety and packets are handed out as pointers into the
+ * mapping, so they remain valid until the reader is closed.  Anything that
+ * cannot be mapped is read through a large buffer instead, in which case a
+ * packet is only valid until the next call to Next().
+ */
+class TraceReader
+{
+public:
+	TraceReader() : Path(NULL), FD(-1), Map(NULL), Buffer(NULL), Size(0), Offset(0), End(0), Eof(false), Failed(false), Owner(true) { }
+	~TraceReader() { Close(); }
+
+	/* Opens a trace, mapping it if possible unless map is false */
+	bool Open(const char *path, bool map = true)
+	{
+		Path = path;
+
+		FD = open(path, O_RDONLY);
+		if (FD < 0) {
+			fprintf(stderr, "error: unable to open file: %s: %s\n", path, strerror(errno));
+			return false;
+		}
+
+		struct stat st;
+		if (fstat(FD, &st) < 0) {
+			fprintf(stderr, "error: unable to stat file: %s: %s\n", path, strerror(errno));
+			Close();
+			return false;
+		}
+
+		if (map && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+			if (map != MAP_FAILED) {
+				Map = (const uint8_t *)map;
+				Size = End = st.st_size;
+
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+				madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+				return true;
+			}
+		}
+
+		Buffer = (uint8_t *)malloc(TRACE_READ_BUFFER_SIZE);
+		if (!Buffer) {
+			fprintf(stderr, "error: unable to allocate read buffer: %s\n", path);
+			Close();
+			return false;
+		}
+
+		if (S_ISREG(st.st_mode)) Size = st.st_size;
+		return true;
+	}
+
+	void Close()
+	{
+		if (Map && Owner) munmap((void *)Map, Size);
+		if (Buffer) free(Buffer);
+		if (FD >= 0) close(FD);
+
+		Map = NULL;
+		Buffer = NULL;
+		FD = -1;
+		Owner = true;
+	}
+
+	/*
+	 * Makes this reader a view of the bytes [begin, end) of another, mapped,
+	 * reader.  Any number of views can be read concurrently.
+	 */
+	void Slice(const TraceReader& parent, uint64_t begin, uint64_t end)
+	{
+		Close();
+
+		Path = parent.Path;
+		Map = parent.Map;
+		Size = parent.Size;
+		Offset = begin;
+		End = end;
+		Eof = true;
+		Failed = false;
+		Owner = false;
+	}
+
+	/* Returns the next packet, or NULL at the end of the trace or on error */
+	inline const TracePacket *Next()
+	{
+		if (End - Offset < TRACE_PACKET_MAX_SIZE && !Map && !Eof) {
+			if (!Refill()) return NULL;
+		}
+
+		if (Offset >= End) return NULL;
+
+		const uint8_t *base = Map ? Map : Buffer;
+		const TracePacket *packet = (const TracePacket *)(base + Offset);
+
+		size_t size = TracePacketSize(packet->Type);
+		if (size == 0) {
+			fprintf(stderr, "error: %s: unknown log packet type: %d\n", Path, packet->Type);
+			Failed = true;
+			Offset = End;
+			return NULL;
+		} else if (size > End - Offset) {
+			fprintf(stderr, "error: %s: truncated packet\n", Path);
+			Failed = true;
+			Offset = End;
+			return NULL;
+		}
+
+		Offset += size;
+		return packet;
+	}
+
+	/* Copies out the next size bytes of raw input, for framed formats */
+	bool Read(void *data, size_t size)
+	{
+		uint8_t *out = (uint8_t *)data;
+
+		while (size) {
+			if (Offset == End && !Map && !Eof) {
+				if (!Refill()) return false;
+			}
+
+			if (Offset == End) return false;
+
+			const uint8_t *base = Map ? Map : Buffer;
+			size_t available = End - Offset;
+			size_t n = size < available ? size : available;
+
+			memcpy(out, base + Offset, n);
+			Offset += n;
+			out += n;
+			size -= n;
+		}
+
+		return true;
+	}
+
+	const char *GetPath() const { return Path; }
+	bool Mapped() const { return Map != NULL; }
+	bool Error() const { return Failed; }
+
+	/* Offset into a mapped trace of the packet the next call to Next() returns */
+	uint64_t GetOffset() const { return Offset; }
+
+	/* Size of the trace in bytes, or zero if it is not known in advance */
+	uint64_t GetSize() const { return Size; }
+
+private:
+	bool Refill()
+	{
+		size_t remaining = End - Offset;
+		memmove(Buffer, Buffer + Offset, remaining);
+		Offset = 0;
+		End = remaining;
+
+		while (End < TRACE_READ_BUFFER_SIZE) {
+			ssize_t rc = read(FD, Buffer + End, TRACE_READ_BUFFER_SIZE - End);
+			if (rc < 0) {
+				if (errno == EINTR) continue;
+
+				fprintf(stderr, "error: %s: packet read error: %s\n", Path, strerror(errno));
+				Failed = true;
+				return false;
+			} else if (rc == 0) {
+				Eof = true;
+				break;
+			}
+
+			End += rc;
+
+			// Don't hold up a live producer waiting for a full buffer.
+			if (End >= TRACE_PACKET_MAX_SIZE) break;
+		}
+
+		return true;
+	}
+
+	const char *Path;
+	int FD;
+
+	const uint8_t *Map;
+	uint8_t *Buffer;
+
+	uint64_t Size;
+	uint64_t Offset, End;
+	bool Eof, Failed, Owner;
+};
+
+#endif /* TRACE_READER_H */